@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/*
+ * Benchmark of the file system functions.
+ *
+ * Usage: paths [DIR...]
+ *
+ * Each case is run in every 'DIR' (by default '/dev/shm', usually a tmpfs, and
+ * '/var/tmp', usually on disk), and the timings are written to stdout as JSON
+ * lines named "DIR:case", as by 'exio_time_output()'. Must be compiled with
+ * 'EXIO_USE_TIMING' defined.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+#ifndef EXIO_USE_TIMING
+#  error "EXIO_USE_TIMING must be defined"
+#endif
+
+#define ITERATIONS  1000
+#define BATCH       64
+#define NAMES       64
+
+static const int depths[] = { 1, 4, 16 };
+
+/* Timed scopes are identified by the address of their name, so names made at
+   run time are kept for the whole run. */
+static char names[NAMES][128];
+static int  nnames;
+
+static const char *name(const char *dir, const char *what, int depth)
+{
+    char *n = names[nnames++];
+
+    EXIO_CHECK(nnames <= NAMES);
+
+    if (depth)
+        snprintf(n, sizeof(*names), "%s:%s/depth%d", dir, what, depth);
+    else
+        snprintf(n, sizeof(*names), "%s:%s", dir, what);
+
+    return n;
+}
+
+/* Write the path of 'depth' components under 'base' into 'buf', with 'leaf' as
+   the last one, so that a case at depth N creates N directories when none of
+   them exist. */
+static void deep_path(char *buf, const char *base, int depth, const char *leaf)
+{
+    int len = snprintf(buf, PATH_MAX, "%s", base), i;
+
+    for (i = 1; i < depth; ++i)
+        len += snprintf(buf + len, PATH_MAX - len, "/d%d", i);
+
+    snprintf(buf + len, PATH_MAX - len, "/%s", leaf);
+}
+
+static void bench_mkpath(const char *dir, const char *root)
+{
+    char   base[PATH_MAX], path[PATH_MAX], leaf[32];
+    size_t d;
+    int    i;
+
+    for (d = 0; d < sizeof(depths) / sizeof(*depths); ++d) {
+        const char *new = name(dir, "mkpath/new", depths[d]);
+        const char *partial = name(dir, "mkpath/partial", depths[d]);
+        const char *existing = name(dir, "mkpath/existing", depths[d]);
+
+        /* Every component under an existing base is new */
+        for (i = 0; i < ITERATIONS; ++i) {
+            snprintf(base, sizeof(base), "%s/new%d-%d", root, depths[d], i);
+            EXIO_CHECK(mkdir(base, 0755) == 0);
+            deep_path(path, base, depths[d], "leaf");
+            {
+                EXIO_TIME_SCOPE(new);
+                EXIO_CHECK(mkpath(path));
+            }
+        }
+
+        /* Only the last component is new */
+        snprintf(base, sizeof(base), "%s/partial%d", root, depths[d]);
+        deep_path(path, base, depths[d], "leaf");
+        EXIO_CHECK(mkpath(path));
+
+        for (i = 0; i < ITERATIONS; ++i) {
+            snprintf(leaf, sizeof(leaf), "leaf%d", i);
+            deep_path(path, base, depths[d], leaf);
+            {
+                EXIO_TIME_SCOPE(partial);
+                EXIO_CHECK(mkpath(path));
+            }
+        }
+
+        /* Nothing is new */
+        deep_path(path, base, depths[d], "leaf");
+
+        for (i = 0; i < ITERATIONS; ++i) {
+            EXIO_TIME_SCOPE(existing);
+            EXIO_CHECK(mkpath(path));
+        }
+    }
+}
+
+static void bench_fsize(const char *dir, const char *root)
+{
+    const char *by_fd = name(dir, "fsize/fd", 0);
+    const char *by_path = name(dir, "fsize/path", 0);
+    const char *batch = name(dir, "fsize/batch64", 0);
+
+    char path[PATH_MAX];
+    int  fds[BATCH], i, j;
+
+    for (j = 0; j < BATCH; ++j) {
+        snprintf(path, sizeof(path), "%s/file%d", root, j);
+        EXIO_CHECK((fds[j] = open(path, O_RDWR | O_CREAT, 0644)) != -1);
+        EXIO_CHECK(write(fds[j], path, j + 1) == j + 1);
+    }
+
+    for (i = 0; i < ITERATIONS; ++i) {
+        EXIO_TIME_SCOPE(by_fd);
+        EXIO_CHECK(fsize(fds[i % BATCH]) > 0);
+    }
+
+    /* Opening the file is part of the cost when only its path is known */
+    for (i = 0; i < ITERATIONS; ++i) {
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/file%d", root, i % BATCH);
+        {
+            EXIO_TIME_SCOPE(by_path);
+            EXIO_CHECK((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1);
+            EXIO_CHECK(fsize(fd) > 0);
+            close(fd);
+        }
+    }
+
+    for (i = 0; i < ITERATIONS / BATCH; ++i) {
+        EXIO_TIME_SCOPE(batch);
+
+        for (j = 0; j < BATCH; ++j)
+            EXIO_CHECK(fsize(fds[j]) > 0);
+    }
+
+    for (j = 0; j < BATCH; ++j) close(fds[j]);
+}
+
+static void bench_xdg(void)
+{
+    static const char var[] = "XDG_CONFIG_HOME";
+
+    char path[PATH_MAX + 1];
+    int  i;
+
+    /* Nothing is cached between lookups, so each one reads the environment */
+    setenv(var, "/tmp/config", 1);
+
+    for (i = 0; i < ITERATIONS; ++i) {
+        EXIO_TIME_SCOPE("xdg/env");
+        EXIO_CHECK(get_xdg_path(path, "app", var, ".config") == 0);
+    }
+
+    /* Falling back to the home directory looks up both variables */
+    unsetenv(var);
+
+    for (i = 0; i < ITERATIONS; ++i) {
+        EXIO_TIME_SCOPE("xdg/fallback");
+        EXIO_CHECK(get_xdg_path(path, "app", var, ".config") != -1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static char *defaults[] = { "/dev/shm", "/var/tmp" };
+
+    char **dirs = argc > 1 ? argv + 1 : defaults;
+    int    ndirs = argc > 1 ? argc - 1 : 2, i;
+    char   root[256], cmd[sizeof(root) + 16];
+
+    exio_time_output(stdout);
+    bench_xdg();
+
+    for (i = 0; i < ndirs; ++i) {
+        if (snprintf(root, sizeof(root), "%s/exio-bench-XXXXXX", dirs[i])
+                >= (int) sizeof(root)
+            || !mkdtemp(root)) {
+            warn("skipping '%s'", dirs[i]);
+            continue;
+        }
+
+        bench_mkpath(dirs[i], root);
+        bench_fsize(dirs[i], root);
+
+        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+        EXIO_CHECK(system(cmd) == 0);
+    }
+
+    return exio_time_report() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
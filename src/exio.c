@@ -4,7 +4,7 @@
  *
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -12,185 +12,5868 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
 
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/statvfs.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#  include <linux/fs.h>
+#  include <sys/inotify.h>
+#  include <sys/prctl.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#  include <nmmintrin.h>
+#  define HAVE_CRC32C_X86
+#elif defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#  define HAVE_CRC32C_ARM
+#endif
 
 #include "exio.h"
 
-#define PREF_ERROR      "error: "
-#define PREF_WARNING    "warning: "
-#define PREF_INFO       "info: "
+#define PREF_ERROR      "error: "
+#define PREF_WARNING    "warning: "
+#define PREF_INFO       "info: "
+
+#define CHAR_YES    'y'
+#define CHAR_NO     'n'
+
+#define TIME_SLOTS          64      /* Must be a power of 2. */
+#define TIME_BUCKETS        40
+
+#define DIRCACHE_MAX        64      /* Default budget of cached descriptors. */
+#define DIRCACHE_BUCKETS    128     /* Must be a power of 2. */
+
+#define SECRET_MAX          65536   /* For secrets of unknown size. */
+#define SECURE_HDR          16      /* Keeps the secure data aligned. */
+#define MEM_HDR             32      /* Keeps allocations aligned as by 'malloc'. */
+#define SCRATCH_MIN         (16 * 1024)
+#define SCRATCH_TRIM        256     /* Operations between trims. */
+
+#define DASH_COLS           512     /* Cells of a row, beyond which it is cut. */
+#define DASH_STYLES         32
+
+#define POOL_DEQUE_MIN      64
+#define COPY_BUF            (128 * 1024)
+#define WRITER_BUF          (4 * 1024 * 1024)
+#define WRITER_ALIGN        4096    /* Satisfies 'O_DIRECT' on common devices. */
+#define MAPLOG_HDR          65536   /* A multiple of every common page size. */
+#define MAPLOG_WINDOW       (64 * 1024 * 1024)
+#define MAPLOG_MAX          (SIZE_MAX > 0xffffffff ? (size_t) 16 << 30 \
+                                                   : (size_t) 256 << 20)
+#define MAPLOG_MAGIC        UINT64_C(0x31474f4c4f495845)   /* "EXIOLOG1" */
+#define JOURNAL_MAGIC       UINT64_C(0x314e524a4f495845)   /* "EXIOJRN1" */
+#define JOURNAL_SYNC        (64 * 1024)     /* Data between sync markers. */
+#define JOURNAL_SYNC_TYPE   0xff
+
+#define FSINFO_MAX          32
+#define FSINFO_INTERVAL     1000    /* Default refresh interval in ms. */
+
+#define HASH_MMAP_MIN       (1024 * 1024)
+#define CRC32C_POLY         0x82f63b78  /* Reversed Castagnoli polynomial. */
+
+#define GLOB_SEGS_MAX       63      /* Segments fit in the state bitmask. */
+#define DIRENT_BUF          (32 * 1024)
+
+#define FOLLOW_BUF          (64 * 1024)
+#define FOLLOW_LINE_MAX     (1024 * 1024)   /* Longer lines are split. */
+#define FOLLOW_POLL_MS      1000    /* Interval of checks without events. */
+
+#define TEE_CHUNK           (1024 * 1024)
+#define TEE_BUF             (1024 * 1024)   /* Bound on buffering for outputs. */
+
+#define USAGE_BUF           1024    /* Fits '/proc/self/stat' and '/proc/self/io'. */
+
+#define PAR_CHUNK_MIN       (1024 * 1024)
+#define PAR_CHUNKS          4       /* Per thread, to balance the load. */
+
+#define BULK_MAX            64
+#define COREDUMP_FILTER     "/proc/self/coredump_filter"
+#define COREDUMP_SMALL      "0x11"  /* Private anonymous memory and ELF headers. */
+
+#define STR_EQ(a, b) (strcmp(a, b) == 0)
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(*(a)))
+
+#define MSG_MAX     1024    /* Messages longer than this are not atomic.      */
+#define CTX_MAX     8       /* Maximum depth of the thread context.         */
+#define CTX_LEN     256     /* Maximum length of the serialised context.    */
+
+#define MSG(level, pref, format)                                    \
+    do {                                                            \
+        va_list ap;                                                 \
+        bool ret;                                                   \
+                                                                    \
+        va_start(ap, (format));                                     \
+        ret = vmsg((level), (pref), sizeof(pref) - 1, (format), ap);\
+        va_end(ap);                                                 \
+                                                                    \
+        return ret;                                                 \
+    } while (0)
+
+#ifdef EXIO_ALLOC_STATS
+/* Heap usage of the library. */
+static struct {
+    size_t   current, peak;
+    uint64_t count;
+} mem_stats;
+#endif
+
+static void *libc_alloc(size_t size, void *ctx)
+{
+    (void) ctx;
+    return malloc(size);
+}
+
+static void *libc_realloc(void *ptr, size_t old_size, size_t size, void *ctx)
+{
+    (void) old_size, (void) ctx;
+    return realloc(ptr, size);
+}
+
+static void libc_free(void *ptr, size_t size, void *ctx)
+{
+    (void) size, (void) ctx;
+    free(ptr);
+}
+
+static const struct exio_allocator  mem_libc = { libc_alloc, libc_realloc,
+                                                 libc_free, NULL };
+static const struct exio_allocator *mem_allocator = &mem_libc;
+
+/* Allocations are preceded by a header holding their allocator and size, and
+   the offset of the data, so that they are freed correctly and usage is
+   tracked without the callers remembering anything. */
+struct mem_hdr {
+    const struct exio_allocator *a;
+    size_t                       size;      // Requested by the caller
+    size_t                       total;     // Obtained from the allocator
+    size_t                       offset;
+};
+
+static const struct exio_allocator *mem_get(const struct exio_allocator *a)
+{
+    return a ? a : __atomic_load_n(&mem_allocator, __ATOMIC_ACQUIRE);
+}
+
+#ifdef EXIO_ALLOC_STATS
+static void mem_add(size_t size)
+{
+    size_t cur = __atomic_add_fetch(&mem_stats.current, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&mem_stats.peak, __ATOMIC_RELAXED);
+
+    while (cur > peak
+           && !__atomic_compare_exchange_n(&mem_stats.peak, &peak, cur, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    __atomic_add_fetch(&mem_stats.count, 1, __ATOMIC_RELAXED);
+}
+
+static void mem_sub(size_t size)
+{
+    __atomic_sub_fetch(&mem_stats.current, size, __ATOMIC_RELAXED);
+}
+#else
+#  define mem_add(size)     ((void) (size))
+#  define mem_sub(size)     ((void) (size))
+#endif
+
+static struct mem_hdr *mem_hdr(void *ptr)
+{
+    return (struct mem_hdr *) ptr - 1;
+}
+
+/* Allocate 'size' bytes aligned to 'align', which must be a power of 2 no
+   smaller than 'MEM_HDR'. */
+static void *mem_alloc_aligned(size_t align, size_t size)
+{
+    const struct exio_allocator *a = mem_get(NULL);
+
+    struct mem_hdr *hdr;
+    char           *base, *ptr;
+    size_t          total;
+
+    /* Allocators only guarantee the alignment of 'malloc()', so the data is
+       aligned within a larger block */
+    if (size > SIZE_MAX - MEM_HDR - align
+        || !(base = a->alloc(total = MEM_HDR + align + size, a->ctx))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ptr = base + MEM_HDR + (-(uintptr_t) (base + MEM_HDR) & (align - 1));
+
+    hdr = mem_hdr(ptr);
+    hdr->a = a, hdr->size = size, hdr->total = total, hdr->offset = ptr - base;
+    mem_add(size);
+
+    return ptr;
+}
+
+static void *mem_alloc(size_t size)
+{
+    const struct exio_allocator *a = mem_get(NULL);
+
+    struct mem_hdr *hdr;
+    char           *base;
+
+    if (size > SIZE_MAX - MEM_HDR
+        || !(base = a->alloc(MEM_HDR + size, a->ctx))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    hdr = mem_hdr(base + MEM_HDR);
+    hdr->a = a, hdr->size = size, hdr->total = MEM_HDR + size;
+    hdr->offset = MEM_HDR;
+    mem_add(size);
+
+    return base + MEM_HDR;
+}
+
+static void *mem_calloc(size_t n, size_t size)
+{
+    void *ptr;
+
+    if (size && n > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if ((ptr = mem_alloc(n * size))) memset(ptr, 0, n * size);
+    return ptr;
+}
+
+static char *mem_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char  *ptr;
+
+    if ((ptr = mem_alloc(len))) memcpy(ptr, str, len);
+    return ptr;
+}
+
+/* Resize 'ptr', which must not come from 'mem_alloc_aligned()'. */
+static void *mem_realloc(void *ptr, size_t size)
+{
+    const struct exio_allocator *a;
+
+    struct mem_hdr *hdr;
+    char           *base;
+    size_t          old;
+
+    if (!ptr) return mem_alloc(size);
+
+    hdr = mem_hdr(ptr);
+    a = hdr->a, old = hdr->size;
+
+    if (size > SIZE_MAX - MEM_HDR
+        || !(base = a->realloc((char *) ptr - MEM_HDR, hdr->total,
+                               MEM_HDR + size, a->ctx))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    hdr = mem_hdr(base + MEM_HDR);
+    hdr->size = size, hdr->total = MEM_HDR + size;
+    mem_sub(old);
+    mem_add(size);
+
+    return base + MEM_HDR;
+}
+
+static void mem_free(void *ptr)
+{
+    struct mem_hdr *hdr;
+
+    if (!ptr) return;
+
+    hdr = mem_hdr(ptr);
+    mem_sub(hdr->size);
+    hdr->a->free((char *) ptr - hdr->offset, hdr->total, hdr->a->ctx);
+}
+
+void exio_set_allocator(const struct exio_allocator *a)
+{
+    __atomic_store_n(&mem_allocator, a ? a : &mem_libc, __ATOMIC_RELEASE);
+}
+
+#ifdef EXIO_ALLOC_STATS
+void exio_alloc_stats(struct exio_alloc_stats *stats, bool reset)
+{
+    stats->current = __atomic_load_n(&mem_stats.current, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&mem_stats.peak, __ATOMIC_RELAXED);
+    stats->count = __atomic_load_n(&mem_stats.count, __ATOMIC_RELAXED);
+
+    if (reset) {
+        __atomic_store_n(&mem_stats.peak, stats->current, __ATOMIC_RELAXED);
+        __atomic_store_n(&mem_stats.count, 0, __ATOMIC_RELAXED);
+    }
+}
+#endif
+
+/* A block of a scratch arena. */
+struct scratch_block {
+    struct scratch_block *prev;         // Older block
+    size_t                size, used;
+    char                  data[];
+};
+
+/* The scratch arena of a thread, for temporary buffers. Memory is handed out
+   from the newest block and released in stack order, back to a mark. The base
+   block is kept between operations, resized to fit the largest operation, and
+   periodically trimmed if it turns out to be too large. */
+struct scratch {
+    struct scratch_block *base, *top;
+    size_t                used;         // In all blocks
+    size_t                high;         // Highest use since the last trim
+    unsigned              ops;          // Operations since the last trim
+};
+
+struct scratch_mark {
+    struct scratch_block *block;
+    size_t                used;
+};
+
+static __thread struct scratch *scratch;
+static pthread_key_t            scratch_key;
+static pthread_once_t           scratch_once = PTHREAD_ONCE_INIT;
+
+static struct scratch_block *scratch_block_new(size_t size)
+{
+    struct scratch_block *b;
+
+    if (size > SIZE_MAX - sizeof(*b) || !(b = mem_alloc(sizeof(*b) + size)))
+        return NULL;
+
+    b->prev = NULL;
+    b->size = size, b->used = 0;
+
+    return b;
+}
+
+static void scratch_free(void *arg)
+{
+    struct scratch       *s = arg;
+    struct scratch_block *b;
+
+    while ((b = s->top)) {
+        s->top = b->prev;
+        mem_free(b);
+    }
+
+    mem_free(s);
+    scratch = NULL;
+}
+
+static void scratch_key_create(void)
+{
+    pthread_key_create(&scratch_key, scratch_free);
+}
+
+static struct scratch *scratch_get(void)
+{
+    struct scratch *s;
+
+    if (scratch) return scratch;
+
+    pthread_once(&scratch_once, scratch_key_create);
+
+    if (!(s = mem_calloc(1, sizeof(*s)))) return NULL;
+
+    if (!(s->base = scratch_block_new(SCRATCH_MIN))) {
+        mem_free(s);
+        return NULL;
+    }
+
+    s->top = s->base;
+    pthread_setspecific(scratch_key, s);
+
+    return scratch = s;
+}
+
+/* Mark the current state of the scratch arena of the calling thread, to start
+   an operation using it. This never fails, as an arena which does not exist
+   yet is marked as empty, with a NULL block. */
+static struct scratch_mark scratch_mark(void)
+{
+    struct scratch_mark m = { NULL, 0 };
+
+    if (scratch) m.block = scratch->top, m.used = scratch->top->used;
+    return m;
+}
+
+/* Allocate 'size' bytes from the scratch arena of the calling thread, until
+   the enclosing mark is released. */
+static void *scratch_alloc(size_t size)
+{
+    struct scratch       *s = scratch_get();
+    struct scratch_block *b;
+
+    size_t off;
+
+    if (!s) return NULL;
+
+    off = (s->top->used + 15) & ~(size_t) 15;
+
+    if (off > s->top->size || s->top->size - off < size) {
+        if (!(b = scratch_block_new(size > s->top->size * 2 ? size
+                                                            : s->top->size * 2)))
+            return NULL;
+
+        b->prev = s->top;
+        s->top = b, off = 0;
+    }
+
+    s->used += off + size - s->top->used;
+    s->top->used = off + size;
+    if (s->used > s->high) s->high = s->used;
+
+    return s->top->data + off;
+}
+
+/* Release everything allocated from the scratch arena since 'm'. */
+static void scratch_release(struct scratch_mark m)
+{
+    struct scratch       *s = scratch;
+    struct scratch_block *b;
+
+    size_t size;
+
+    if (!s) return;
+
+    /* The arena was created after the mark, so everything in it goes */
+    if (!m.block) m.block = s->base, m.used = 0;
+
+    while (s->top != m.block) {
+        b = s->top;
+        s->top = b->prev;
+        s->used -= b->used;
+        mem_free(b);
+    }
+
+    s->used -= s->top->used - m.used;
+    s->top->used = m.used;
+
+    /* Between operations, make the base block fit the largest recent one */
+    if (s->used || s->top != s->base) return;
+
+    size = s->high > s->base->size ? s->high : s->base->size;
+
+    if (++s->ops == SCRATCH_TRIM) {
+        if (s->high < size / 4)
+            size = s->high * 2 > SCRATCH_MIN ? s->high * 2 : SCRATCH_MIN;
+
+        s->ops = 0, s->high = 0;
+    }
+
+    if (size != s->base->size && (b = scratch_block_new(size))) {
+        mem_free(s->base);
+        s->base = s->top = b;
+    }
+}
+
+/* The monotonic time in nanoseconds. */
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Wait on 'cond' for up to 'ns' nanoseconds. */
+static void cond_wait_ns(pthread_cond_t *cond, pthread_mutex_t *lock,
+                         uint64_t ns)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec += ns % 1000000000;
+    if (ts.tv_nsec >= 1000000000) ++ts.tv_sec, ts.tv_nsec -= 1000000000;
+
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    for (; len > 0; buf = (const char *) buf + n, len -= n) {
+        if ((n = write(fd, buf, len)) == -1) {
+            if (errno != EINTR) return false;
+            n = 0;
+        }
+    }
+
+    return true;
+}
+
+/* Context fields of the calling thread, serialised as the message prefix
+   "[key=val key=val] ". Each field ends at the corresponding offset in 'ends',
+   so the prefix is updated in place as fields are pushed and popped. */
+struct msg_ctx {
+    size_t depth;
+    size_t ends[CTX_MAX];
+    size_t len;
+    char   prefix[CTX_LEN];
+};
+
+static __thread struct msg_ctx msg_ctx;
+
+/* The dashboard messages are written through, if any. */
+static struct exio_dashboard *dash_active;
+static pthread_mutex_t        dash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool dash_message(const char *buf, size_t len);
+
+/* A buffer of messages. The length is kept with the data and published after
+   it is copied, so that signal handlers can write out what is complete without
+   taking the lock. Replaced buffers are kept for reuse and never freed, as a
+   handler may still be writing one out. */
+struct msg_block {
+    struct msg_block *next;             // Replaced buffers
+    size_t            cap, len;
+    char              data[];
+};
+
+/* Messages buffered with 'exio_msg_buffer()'. */
+static struct {
+    struct msg_block *cur, *retired;
+    size_t            size;
+    unsigned          lines, max_lines;
+    uint64_t          max_ns;
+    uint64_t          first;            // When the oldest message was buffered
+    pthread_t         thread;
+    bool              running, stop;
+} msgbuf;
+
+static pthread_mutex_t msgbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  msgbuf_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t  msgbuf_once = PTHREAD_ONCE_INIT;
+
+/* Log which messages are appended to instead, see 'exio_msg_maplog()'. */
+static struct exio_maplog *msg_maplog;
+
+/* Journal which messages are also recorded in, see 'exio_msg_journal()'. */
+static struct exio_journal *msg_journal;
+
+/* Write out the buffered messages. Must be called with the lock held. */
+static bool msgbuf_flush(void)
+{
+    struct msg_block *b = msgbuf.cur;
+    bool              ret;
+
+    if (!b || !b->len) return true;
+
+    /* The length is only reset afterwards, as a message written twice by a
+       signal handler is better than a lost one */
+    fflush(stderr);
+    ret = write_all(STDERR_FILENO, b->data, b->len);
+    __atomic_store_n(&b->len, 0, __ATOMIC_RELEASE);
+    msgbuf.lines = 0;
+
+    return ret;
+}
+
+/* Write out the buffered messages from a signal handler. */
+static void msgbuf_flush_signal(void)
+{
+    struct msg_block *b = __atomic_load_n(&msgbuf.cur, __ATOMIC_ACQUIRE);
+    size_t            len = b ? __atomic_load_n(&b->len, __ATOMIC_ACQUIRE) : 0;
+
+    if (len && write(STDERR_FILENO, b->data, len) != -1)
+        __atomic_store_n(&b->len, 0, __ATOMIC_RELEASE);
+}
+
+static bool msgbuf_write(enum msg_level level, const char *buf, size_t len)
+{
+    struct msg_block *b;
+
+    bool ret = true;
+
+    pthread_mutex_lock(&msgbuf_lock);
+
+    if (!(b = msgbuf.cur)) {
+        pthread_mutex_unlock(&msgbuf_lock);
+        return fwrite(buf, 1, len, stderr) == len;
+    }
+
+    if (b->len + len > msgbuf.size) ret = msgbuf_flush();
+
+    if (len > msgbuf.size) {
+        ret &= write_all(STDERR_FILENO, buf, len);
+    } else {
+        if (!b->len) {
+            msgbuf.first = clock_ns();
+            pthread_cond_signal(&msgbuf_cond);
+        }
+
+        memcpy(b->data + b->len, buf, len);
+        __atomic_store_n(&b->len, b->len + len, __ATOMIC_RELEASE);
+        ++msgbuf.lines;
+    }
+
+    /* Errors are never held back */
+    if (level == LEVEL_ERROR
+        || (msgbuf.max_lines && msgbuf.lines >= msgbuf.max_lines))
+        ret &= msgbuf_flush();
+
+    pthread_mutex_unlock(&msgbuf_lock);
+    return ret;
+}
+
+/* Flush the buffer once its oldest message is 'max_ns' old. */
+static void *msgbuf_work(void *arg)
+{
+    uint64_t deadline, now;
+
+    (void) arg;
+    pthread_mutex_lock(&msgbuf_lock);
+
+    while (!msgbuf.stop) {
+        if (!msgbuf.cur->len) {
+            pthread_cond_wait(&msgbuf_cond, &msgbuf_lock);
+            continue;
+        }
+
+        deadline = msgbuf.first + msgbuf.max_ns;
+
+        if ((now = clock_ns()) >= deadline)
+            msgbuf_flush();
+        else
+            cond_wait_ns(&msgbuf_cond, &msgbuf_lock, deadline - now);
+    }
+
+    pthread_mutex_unlock(&msgbuf_lock);
+    return NULL;
+}
+
+static void msgbuf_exit(void)
+{
+    exio_msg_flush();
+}
+
+static void msgbuf_register(void)
+{
+    atexit(msgbuf_exit);
+}
+
+/* Stop the timer thread, if any. */
+static void msgbuf_stop(void)
+{
+    pthread_mutex_lock(&msgbuf_lock);
+
+    if (!msgbuf.running) {
+        pthread_mutex_unlock(&msgbuf_lock);
+        return;
+    }
+
+    msgbuf.stop = true;
+    pthread_cond_signal(&msgbuf_cond);
+    pthread_mutex_unlock(&msgbuf_lock);
+
+    pthread_join(msgbuf.thread, NULL);
+    msgbuf.running = msgbuf.stop = false;
+}
+
+bool exio_msg_buffer(size_t size, unsigned max_lines, unsigned max_ms)
+{
+    struct msg_block *b = NULL, **p;
+
+    bool ret;
+    int  error = 0;
+
+    msgbuf_stop();
+
+    pthread_once(&msgbuf_once, msgbuf_register);
+    pthread_mutex_lock(&msgbuf_lock);
+
+    if (size) {
+        for (p = &msgbuf.retired; *p && (*p)->cap < size; p = &(*p)->next);
+
+        if (*p) {
+            b = *p, *p = b->next;
+        } else if ((b = mem_alloc(sizeof(*b) + size))) {
+            b->cap = size, b->len = 0;
+        } else {
+            pthread_mutex_unlock(&msgbuf_lock);
+            return false;
+        }
+    }
+
+    ret = msgbuf_flush();
+    error = errno;
+
+    /* The old buffer is empty now, so a handler still holding it writes
+       nothing */
+    if (msgbuf.cur) {
+        msgbuf.cur->next = msgbuf.retired;
+        msgbuf.retired = msgbuf.cur;
+    }
+
+    __atomic_store_n(&msgbuf.cur, b, __ATOMIC_RELEASE);
+    msgbuf.size = size;
+    msgbuf.max_lines = max_lines;
+    msgbuf.max_ns = (uint64_t) max_ms * 1000000;
+
+    if (b && max_ms) {
+        if ((error = pthread_create(&msgbuf.thread, NULL, msgbuf_work, NULL)))
+            ret = false;
+        else
+            msgbuf.running = true;
+    }
+
+    pthread_mutex_unlock(&msgbuf_lock);
+
+    if (!ret) errno = error;
+    return ret;
+}
+
+bool exio_msg_flush(void)
+{
+    bool ret;
+
+    pthread_mutex_lock(&msgbuf_lock);
+    ret = msgbuf_flush();
+    pthread_mutex_unlock(&msgbuf_lock);
+
+    return ret;
+}
+
+void exio_msg_journal(struct exio_journal *j)
+{
+    __atomic_store_n(&msg_journal, j, __ATOMIC_RELEASE);
+}
+
+/* Record the text 'text' of a message in the journal, if any. */
+static bool msg_record(enum msg_level level, const char *text, size_t len)
+{
+    struct exio_journal *j = __atomic_load_n(&msg_journal, __ATOMIC_ACQUIRE);
+
+    return !j || exio_journal_write(j, level, text, len);
+}
+
+void exio_msg_maplog(struct exio_maplog *l)
+{
+    exio_msg_flush();
+    __atomic_store_n(&msg_maplog, l, __ATOMIC_RELEASE);
+}
+
+/* Write the complete message 'buf' to the message log, to stderr, or above the
+   active dashboard. */
+static bool msg_write(enum msg_level level, const char *buf, size_t len)
+{
+    struct exio_maplog *l;
+
+    if (EXIO_UNLIKELY(l = __atomic_load_n(&msg_maplog, __ATOMIC_ACQUIRE)))
+        return exio_maplog_append(l, buf, len);
+
+    if (EXIO_UNLIKELY(__atomic_load_n(&dash_active, __ATOMIC_RELAXED))
+        && dash_message(buf, len))
+        return true;
+
+    if (__atomic_load_n(&msgbuf.cur, __ATOMIC_RELAXED))
+        return msgbuf_write(level, buf, len);
+
+    return fwrite(buf, 1, len, stderr) == len;
+}
+
+/* Format a message into a single buffer, so that it is written with a single
+   call (and normally a single system call). */
+static bool vmsg(enum msg_level level, const char *pref, size_t pref_len,
+                 const char *format, va_list ap)
+{
+    struct scratch_mark mark;
+
+    char    buf[MSG_MAX], *long_buf;
+    size_t  len, avail;
+    va_list aq;
+    int     n;
+    bool    ret;
+
+    memcpy(buf, pref, pref_len);
+    memcpy(buf + pref_len, msg_ctx.prefix, msg_ctx.len);
+    len = pref_len + msg_ctx.len;
+    avail = sizeof(buf) - len - 1;      // Room for the newline
+
+    va_copy(aq, ap);
+    n = vsnprintf(buf + len, avail, format, ap);
+
+    if (n < 0) {
+        ret = false;
+    } else if ((size_t) n < avail) {
+        len += n;
+        buf[len++] = '\n';
+        ret = msg_write(level, buf, len);
+        ret &= msg_record(level, buf + pref_len, len - pref_len - 1);
+    } else {
+        /* Overlong messages are formatted in the scratch arena instead, so as
+           to still be written at once, and piecewise without memory */
+        mark = scratch_mark();
+
+        if ((long_buf = scratch_alloc(len + n + 2))) {
+            memcpy(long_buf, buf, len);
+            vsnprintf(long_buf + len, n + 1, format, aq);
+            len += n;
+            long_buf[len++] = '\n';
+            ret = msg_write(level, long_buf, len);
+            ret &= msg_record(level, long_buf + pref_len, len - pref_len - 1);
+        } else {
+            exio_msg_flush();
+            ret = (fwrite(buf, 1, len, stderr) == len
+                   && vfprintf(stderr, format, aq) >= 0
+                   && fputc('\n', stderr) != EOF);
+        }
+
+        scratch_release(mark);
+    }
+
+    va_end(aq);
+    return ret;
+}
+
+bool exio_ctx_push(const char *key, const char *val)
+{
+    struct msg_ctx *ctx = &msg_ctx;
+
+    size_t key_len = strlen(key), val_len = strlen(val);
+    size_t start = ctx->depth ? ctx->len - 2 : 0;   // Overwrite the "] "
+    char  *p;
+
+    // Take the separators '[' or ' ', '=', and "] " into account
+    if (ctx->depth == CTX_MAX || start + key_len + val_len + 4 >= CTX_LEN) {
+        errno = ENOBUFS;
+        return false;
+    }
+
+    p = ctx->prefix + start;
+    *p++ = ctx->depth ? ' ' : '[';
+    memcpy(p, key, key_len), p += key_len;
+    *p++ = '=';
+    memcpy(p, val, val_len), p += val_len;
+
+    ctx->ends[ctx->depth++] = p - ctx->prefix;
+    memcpy(p, "] ", 3);
+    ctx->len = p - ctx->prefix + 2;
+
+    return true;
+}
+
+void exio_ctx_pop(void)
+{
+    struct msg_ctx *ctx = &msg_ctx;
+
+    if (ctx->depth == 0) return;
+
+    if (--ctx->depth == 0) {
+        ctx->len = 0;
+    } else {
+        ctx->len = ctx->ends[ctx->depth - 1];
+        memcpy(ctx->prefix + ctx->len, "] ", 3);
+        ctx->len += 2;
+    }
+
+    ctx->prefix[ctx->len] = '\0';
+}
+
+bool err(const char *restrict format, ...)
+{
+    MSG(LEVEL_ERROR, C_ERROR PREF_ERROR C_NORMAL, format);
+}
+
+bool warn(const char *restrict format, ...)
+{
+    MSG(LEVEL_WARNING, C_WARNING PREF_WARNING C_NORMAL, format);
+}
+
+bool info(const char *restrict format, ...)
+{
+    MSG(LEVEL_INFO, C_INFO PREF_INFO C_NORMAL, format);
+}
+
+void exio_check_fail(const char *file, int line, const char *cond)
+{
+    err("%s:%d: check failed: %s", file, line, cond);
+    abort();
+}
+
+void exio_check_failf(const char *file, int line, const char *cond,
+                      const char *restrict format, ...)
+{
+    char    buf[MSG_MAX];
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+
+    err("%s:%d: check failed: %s: %s", file, line, cond, buf);
+    abort();
+}
+
+/* A cell of a dashboard row: a character (in UTF-8) and its style. Every
+   character is taken to be one column wide. */
+struct dash_cell {
+    char    ch[4];
+    uint8_t len;                        // 0 past the end of the row
+    uint8_t style;                      // Index of the escape sequence
+};
+
+/* A live region of rows at the bottom of the terminal. 'cells' holds the wanted
+   rows, and 'shown' what is on the terminal, so that only the differences are
+   drawn. The cursor is kept at the start of the line below the region. */
+struct exio_dashboard {
+    size_t            rows;
+    unsigned          cols;             // Usable width at the last draw
+    struct dash_cell *cells, *shown;
+    bool              drawn, dirty;
+    uint64_t          interval, last;   // In nanoseconds
+    char             *styles[DASH_STYLES];
+    size_t            nstyles;
+    char             *out;              // Output of a draw
+    size_t            out_len, out_cap;
+    bool              out_failed;
+};
+
+static void dash_put(struct exio_dashboard *d, const char *str, size_t len)
+{
+    char  *out;
+    size_t cap;
+
+    if (d->out_len + len > d->out_cap) {
+        for (cap = d->out_cap ? d->out_cap : 4096; cap < d->out_len + len;
+             cap *= 2);
+
+        if (!(out = mem_realloc(d->out, cap))) {
+            d->out_failed = true;
+            return;
+        }
+
+        d->out = out, d->out_cap = cap;
+    }
+
+    memcpy(d->out + d->out_len, str, len);
+    d->out_len += len;
+}
+
+/* Append the cursor movement 'cmd' by 'n' (if not 0). */
+static void dash_move(struct exio_dashboard *d, size_t n, char cmd)
+{
+    char buf[32];
+
+    if (n) dash_put(d, buf, snprintf(buf, sizeof(buf), "\033[%zu%c", n, cmd));
+}
+
+/* Append the cells 'from' to 'to' of 'row', with their styles. */
+static void dash_cells(struct exio_dashboard *d, const struct dash_cell *row,
+                       size_t from, size_t to)
+{
+    uint8_t style = 0;
+    size_t  i;
+
+    for (i = from; i < to && row[i].len; ++i) {
+        if (row[i].style != style) {
+            style = row[i].style;
+            dash_put(d, "\033[0m", 4);
+            if (style) dash_put(d, d->styles[style], strlen(d->styles[style]));
+        }
+
+        dash_put(d, row[i].ch, row[i].len);
+    }
+
+    if (style) dash_put(d, "\033[0m", 4);
+
+    /* The rest of the row is cleared if it became shorter */
+    if (i < to) dash_put(d, "\033[K", 3);
+}
+
+/* Draw the changes to the dashboard, after writing 'msg' above it if not NULL.
+   Must be called with the lock held. */
+static bool dash_draw(struct exio_dashboard *d, const char *msg, size_t len)
+{
+    const struct dash_cell *row, *old;
+
+    struct winsize ws;
+    unsigned       cols = DASH_COLS;
+    size_t         r, c, first, last, cur;
+    bool           full;
+
+    /* Writing in the last column would wrap the line on some terminals */
+    if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 1
+        && ws.ws_col - 1 < DASH_COLS)
+        cols = ws.ws_col - 1;
+
+    d->out_len = 0, d->out_failed = false;
+    full = msg || !d->drawn || cols != d->cols;
+
+    if (full) {
+        /* Rows which were on the terminal are cleared, so that the message
+           (or the resized rows) scroll in their place */
+        if (d->drawn) {
+            dash_put(d, "\r", 1);
+            dash_move(d, d->rows, 'A');
+            dash_put(d, "\033[J", 3);
+        }
+
+        if (msg) dash_put(d, msg, len);
+
+        for (r = 0; r < d->rows; ++r) {
+            dash_cells(d, d->cells + r * DASH_COLS, 0, cols);
+            dash_put(d, "\r\n", 2);
+        }
+    } else {
+        for (r = 0, cur = d->rows; r < d->rows; ++r) {
+            row = d->cells + r * DASH_COLS, old = d->shown + r * DASH_COLS;
+
+            for (first = cols, last = 0, c = 0; c < cols; ++c) {
+                if (row[c].len == old[c].len && row[c].style == old[c].style
+                    && memcmp(row[c].ch, old[c].ch, row[c].len) == 0)
+                    continue;
+
+                if (first == cols) first = c;
+                last = c + 1;
+            }
+
+            if (first == cols) continue;
+
+            /* Rows are visited downwards, so only the first move is up */
+            if (r < cur)
+                dash_move(d, cur - r, 'A');
+            else
+                dash_move(d, r - cur, 'B');
+
+            dash_move(d, first + 1, 'G');
+            dash_cells(d, row, first, last);
+            cur = r;
+        }
+
+        if (cur == d->rows) return true;    // Nothing changed
+
+        dash_move(d, d->rows - cur, 'B');
+        dash_put(d, "\r", 1);
+    }
+
+    if (d->out_failed) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    /* Anything buffered goes first */
+    exio_msg_flush();
+    fflush(stderr);
+    if (!write_all(STDERR_FILENO, d->out, d->out_len)) return false;
+
+    memcpy(d->shown, d->cells, d->rows * DASH_COLS * sizeof(*d->cells));
+    d->cols = cols;
+    d->drawn = true, d->dirty = false;
+    d->last = clock_ns();
+
+    return true;
+}
+
+static bool dash_message(const char *buf, size_t len)
+{
+    bool ret = false;
+
+    pthread_mutex_lock(&dash_lock);
+    if (dash_active) ret = dash_draw(dash_active, buf, len);
+    pthread_mutex_unlock(&dash_lock);
+
+    return ret;
+}
+
+/* Get the index of the style set by the escape sequence 'seq' of length 'len',
+   adding it if needed. Unknown styles beyond the limit are shown as normal. */
+static uint8_t dash_style(struct exio_dashboard *d, const char *seq, size_t len)
+{
+    size_t i;
+
+    if ((len == 4 && memcmp(seq, "\033[0m", 4) == 0)
+        || (len == 3 && memcmp(seq, "\033[m", 3) == 0))
+        return 0;
+
+    for (i = 1; i < d->nstyles; ++i) {
+        if (strlen(d->styles[i]) == len && memcmp(d->styles[i], seq, len) == 0)
+            return i;
+    }
+
+    if (d->nstyles == DASH_STYLES || !(d->styles[i] = mem_alloc(len + 1)))
+        return 0;
+
+    memcpy(d->styles[i], seq, len);
+    d->styles[i][len] = '\0';
+
+    return d->nstyles++;
+}
+
+struct exio_dashboard *exio_dashboard_new(size_t rows, unsigned interval_ms)
+{
+    struct exio_dashboard *d;
+
+    if (!isatty(STDERR_FILENO)) return NULL;
+
+    if (rows > SIZE_MAX / DASH_COLS / sizeof(*d->cells)
+        || !(d = mem_calloc(1, sizeof(*d))))
+        return NULL;
+
+    d->rows = rows;
+    d->interval = (uint64_t) interval_ms * 1000000;
+    d->nstyles = 1;     // The normal style
+
+    if (!(d->cells = mem_calloc(rows * DASH_COLS, sizeof(*d->cells)))
+        || !(d->shown = mem_calloc(rows * DASH_COLS, sizeof(*d->cells))))
+        goto fail;
+
+    pthread_mutex_lock(&dash_lock);
+
+    if (dash_active) {
+        pthread_mutex_unlock(&dash_lock);
+        errno = EBUSY;
+        goto fail;
+    }
+
+    if (!dash_draw(d, NULL, 0)) {
+        pthread_mutex_unlock(&dash_lock);
+        goto fail;
+    }
+
+    __atomic_store_n(&dash_active, d, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&dash_lock);
+
+    return d;
+
+fail:
+    exio_dashboard_free(d);
+    return NULL;
+}
+
+void exio_dashboard_free(struct exio_dashboard *d)
+{
+    size_t i;
+
+    if (!d) return;
+
+    /* The final state stays on the terminal, above the cursor */
+    pthread_mutex_lock(&dash_lock);
+
+    if (dash_active == d) {
+        if (d->dirty) dash_draw(d, NULL, 0);
+        __atomic_store_n(&dash_active, NULL, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&dash_lock);
+
+    for (i = 1; i < d->nstyles; ++i) mem_free(d->styles[i]);
+    mem_free(d->cells);
+    mem_free(d->shown);
+    mem_free(d->out);
+    mem_free(d);
+}
+
+bool exio_dashboard_set(struct exio_dashboard *d, size_t row,
+                        const char *restrict format, ...)
+{
+    struct scratch_mark mark = scratch_mark();
+    struct dash_cell   *cell;
+
+    const char *p, *end;
+    char       *buf;
+    va_list     ap;
+    size_t      c = 0, n;
+    uint8_t     style = 0;
+    int         len;
+    bool        ret = true;
+
+    va_start(ap, format);
+    len = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+
+    if (len < 0 || !(buf = scratch_alloc(len + 1))) {
+        scratch_release(mark);
+        return false;
+    }
+
+    va_start(ap, format);
+    vsnprintf(buf, len + 1, format, ap);
+    va_end(ap);
+
+    pthread_mutex_lock(&dash_lock);
+
+    if (row >= d->rows) {
+        pthread_mutex_unlock(&dash_lock);
+        scratch_release(mark);
+        errno = EINVAL;
+        return false;
+    }
+
+    cell = d->cells + row * DASH_COLS;
+    memset(cell, 0, DASH_COLS * sizeof(*cell));
+
+    for (p = buf, end = buf + len; p < end && c < DASH_COLS; ) {
+        if (*p == '\033' && p + 1 < end && p[1] == '[') {
+            /* Escape sequences set the style of the following cells */
+            for (n = 2; p + n < end && !(p[n] >= '@' && p[n] <= '~'); ++n);
+            if (p + n < end && p[n] == 'm') style = dash_style(d, p, n + 1);
+            p += n + 1;
+            continue;
+        }
+
+        /* A character spans its continuation bytes */
+        for (n = 1; p + n < end && n < 4 && (p[n] & 0xc0) == 0x80; ++n);
+
+        if ((unsigned char) *p < ' ') {
+            cell[c].ch[0] = ' ', cell[c].len = 1;
+        } else {
+            memcpy(cell[c].ch, p, n);
+            cell[c].len = n;
+        }
+
+        cell[c++].style = style;
+        p += n;
+    }
+
+    d->dirty = true;
+
+    if (dash_active == d && clock_ns() - d->last >= d->interval)
+        ret = dash_draw(d, NULL, 0);
+
+    pthread_mutex_unlock(&dash_lock);
+    scratch_release(mark);
+
+    return ret;
+}
+
+bool exio_dashboard_draw(struct exio_dashboard *d)
+{
+    bool ret = true;
+
+    pthread_mutex_lock(&dash_lock);
+    if (dash_active == d && d->dirty) ret = dash_draw(d, NULL, 0);
+    pthread_mutex_unlock(&dash_lock);
+
+    return ret;
+}
+
+bool confirm(const char *prompt)
+{
+    char in[] = { '\0', '\0', '\0' };
+    int  c;
+
+    exio_msg_flush();
+
+    for (;;) {
+        fputs(prompt, stderr);
+        if (!fgets(in, sizeof(in), stdin)) return false;
+
+        if (in[1] != '\n' && in[0] != '\n') {
+            /* Consume the rest of the input */
+            while ((c = fgetc(stdin)) != '\n' && c != EOF);
+            continue;
+        }
+
+        if (in[0] == CHAR_YES)
+            return true;
+        else if (in[0] == CHAR_NO)
+            return false;
+        else
+            continue;
+    }
+}
+
+/* Erase and free the buffer 'buf' of size 'size' from 'a'. */
+static void line_free(const struct exio_allocator *a, char *buf, size_t size)
+{
+    if (!buf) return;
+
+    explicit_bzero(buf, size);
+    a->free(buf, size, a->ctx);
+}
+
+/* Move the 'len' bytes at the start of 'buf' (of size 'size') into a new buffer
+   of size 'new_size' from 'a'. Buffers are never resized in place, so that no
+   copy of the input is left behind in freed memory. */
+static char *line_move(const struct exio_allocator *a, char *buf, size_t size,
+                       size_t len, size_t new_size)
+{
+    char *new;
+
+    if (!(new = a->alloc(new_size, a->ctx))) {
+        line_free(a, buf, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (buf) memcpy(new, buf, len);
+    line_free(a, buf, size);
+
+    return new;
+}
+
+/* Read a line from 'stdin' into a buffer of size '*len' + 1 from 'a', and set
+   '*len' to its length without the trailing newline. Returns NULL on failure
+   and at EOF without input. */
+static char *read_line(const struct exio_allocator *a, size_t *len)
+{
+    char  *buf = NULL;
+    size_t size = 0, n = 0;
+    int    c;
+
+    flockfile(stdin);
+
+    while ((c = getc_unlocked(stdin)) != EOF && c != '\n') {
+        if (n + 1 == size || !buf) {
+            if (!(buf = line_move(a, buf, size, n, size ? size * 2 : 128)))
+                goto out;
+
+            size = size ? size * 2 : 128;
+        }
+
+        buf[n++] = c;
+    }
+
+    if (ferror(stdin) || (c == EOF && n == 0)) {
+        line_free(a, buf, size);
+        buf = NULL;
+        goto out;
+    }
+
+    /* The buffer is trimmed so that its size is known to the caller */
+    if ((buf = line_move(a, buf, size, n, n + 1))) {
+        buf[n] = '\0';
+        *len = n;
+    }
+
+out:
+    funlockfile(stdin);
+    return buf;
+}
+
+char *exio_getusrln(const char *prompt, size_t *input_len, enum input_mode mode,
+                    const struct exio_allocator *a)
+{
+    struct termios old, new;
+
+    char  *buf;
+    size_t len = 0, n;
+    int    error;
+
+    a = mem_get(a);
+    exio_msg_flush();
+
+    if (mode == IN_HIDE) {
+        /* Test if terminal supports 'termios' */
+        if (tcgetattr(STDIN_FILENO, &old) != 0)
+            return NULL;
+
+        new = old;
+        new.c_lflag &= ~ECHO;
+
+        /* Temporarily disable terminal text echoing to hide input */
+        if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &new) != 0)
+            return NULL;
+    }
+
+    fputs(prompt, stderr);
+    buf = read_line(a, &len);
+    error = errno;
+    if (mode == IN_HIDE || !buf) fputc('\n', stderr);   /* Print the newline entered */
+
+    /* The terminal is restored even on failure */
+    if (mode == IN_HIDE && tcsetattr(STDIN_FILENO, TCSAFLUSH, &old) != 0) {
+        error = errno;
+        line_free(a, buf, buf ? len + 1 : 0);
+        buf = NULL;
+    }
+
+    /* Without the length, the size of the block is that of the string, which
+       ends early if the input holds null bytes */
+    if (buf && !input_len && (n = strlen(buf)) < len) {
+        if ((buf = line_move(a, buf, len + 1, n, n + 1)))
+            buf[n] = '\0';
+        else
+            error = errno;
+    }
+
+    if (buf && input_len) *input_len = len;
+
+    errno = error;
+    return buf;
+}
+
+char *getusrln(const char *prompt, size_t *input_len, enum input_mode mode)
+{
+    return exio_getusrln(prompt, input_len, mode, NULL);
+}
+
+/* A cached directory descriptor. Entries are kept in a hash table by path, and
+   in a list from the most to the least recently used. Invalidated entries are
+   unlinked from both, and closed when no longer referenced. */
+struct dir_entry {
+    struct dir_entry *prev, *next;      // Recency list
+    struct dir_entry *chain;            // Hash bucket
+    size_t            hash;
+    unsigned          refs;
+    int               fd;
+    bool              stale;
+    size_t            len;
+    char              path[];
+};
+
+static struct {
+    pthread_mutex_t   lock;
+    struct dir_entry *buckets[DIRCACHE_BUCKETS];
+    struct dir_entry *head, *tail;
+    struct dir_entry *stale;            // Invalidated but still referenced
+    size_t            count, max;
+} dircache = { PTHREAD_MUTEX_INITIALIZER, { NULL }, NULL, NULL, NULL, 0,
+               DIRCACHE_MAX };
+
+#ifdef O_PATH
+#  define DIRCACHE_OPEN     (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#  define DIRCACHE_OPEN     (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+static size_t path_hash(const char *path, size_t len)
+{
+    size_t hash = 14695981039346656037u & SIZE_MAX, i;
+
+    for (i = 0; i < len; ++i)
+        hash = (hash ^ (unsigned char) path[i]) * (1099511628211u & SIZE_MAX);
+
+    return hash;
+}
+
+/* Normalise the absolute path 'path' into 'buf' by removing redundant '/'
+   characters and "." components. Paths with ".." components are rejected, as
+   resolving them lexically is wrong in the presence of symbolic links. Returns
+   the length of the result, or 0 if 'path' cannot be cached. */
+static size_t path_canon(char *restrict buf, const char *restrict path)
+{
+    const char *end;
+    size_t      len = 0, n;
+
+    if (*path != '/') return 0;
+
+    for (; *path; path = end) {
+        while (*path == '/') ++path;
+        end = strchrnul(path, '/');
+        n = end - path;
+
+        if (n == 0 || (n == 1 && *path == '.')) continue;
+        if (n == 2 && path[0] == '.' && path[1] == '.') return 0;
+        if (len + n + 1 > PATH_MAX) return 0;
+
+        buf[len++] = '/';
+        memcpy(buf + len, path, n);
+        len += n;
+    }
+
+    if (len == 0) buf[len++] = '/';
+    buf[len] = '\0';
+
+    return len;
+}
+
+static struct dir_entry *dircache_find(const char *path, size_t len, size_t hash)
+{
+    struct dir_entry *e = dircache.buckets[hash & (DIRCACHE_BUCKETS - 1)];
+
+    for (; e; e = e->chain) {
+        if (e->hash == hash && e->len == len && memcmp(e->path, path, len) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void dircache_unlink(struct dir_entry *e)
+{
+    struct dir_entry **p = &dircache.buckets[e->hash & (DIRCACHE_BUCKETS - 1)];
+
+    while (*p != e) p = &(*p)->chain;
+    *p = e->chain;
+
+    if (e->prev) e->prev->next = e->next; else dircache.head = e->next;
+    if (e->next) e->next->prev = e->prev; else dircache.tail = e->prev;
+
+    --dircache.count;
+}
+
+static void dircache_front(struct dir_entry *e)
+{
+    if (dircache.head == e) return;
+
+    if (e->prev) e->prev->next = e->next;
+    if (e->next) e->next->prev = e->prev; else if (e->prev) dircache.tail = e->prev;
+
+    e->prev = NULL;
+    e->next = dircache.head;
+    if (dircache.head) dircache.head->prev = e;
+    dircache.head = e;
+    if (!dircache.tail) dircache.tail = e;
+}
+
+/* Remove 'e' from the cache, closing it once it is no longer referenced. */
+static void dircache_drop(struct dir_entry *e)
+{
+    dircache_unlink(e);
+
+    if (e->refs) {
+        e->stale = true;
+        e->next = dircache.stale;
+        dircache.stale = e;
+    } else {
+        close(e->fd);
+        mem_free(e);
+    }
+}
+
+/* Evict unreferenced entries until there is room for another. */
+static bool dircache_evict(void)
+{
+    struct dir_entry *e = dircache.tail, *prev;
+
+    for (; e && dircache.count >= dircache.max; e = prev) {
+        prev = e->prev;
+        if (!e->refs) dircache_drop(e);
+    }
+
+    return dircache.count < dircache.max;
+}
+
+/* Whether the cached directory 'fd' has been removed. */
+static bool dircache_gone(int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) != 0 || st.st_nlink == 0;
+}
+
+/* Get a referenced descriptor for the canonical path 'path' of length 'len',
+   opening it relative to its deepest cached ancestor if needed. 'path' must be
+   null-terminated at 'len'. Must be called with the lock held. */
+static int dircache_acquire(const char *path, size_t len)
+{
+    struct dir_entry *e, *anc = NULL;
+
+    size_t hash = path_hash(path, len), anc_len = len;
+    int    fd, error;
+
+    if ((e = dircache_find(path, len, hash))) {
+        ++e->refs;
+        dircache_front(e);
+        return e->fd;
+    }
+
+    /* Look for the deepest cached ancestor to start from, down to the root */
+    while (anc_len > 1 && !anc) {
+        while (anc_len > 1 && path[--anc_len] != '/');
+        anc = dircache_find(path, anc_len, path_hash(path, anc_len));
+    }
+
+    fd = anc ? openat(anc->fd, path + anc_len + (anc_len > 1), DIRCACHE_OPEN)
+             : open(path, DIRCACHE_OPEN);
+
+    /* The ancestor may have been removed, but a missing descendant is no
+       reason to drop it */
+    if (fd == -1 && anc) {
+        error = errno;
+
+        if (error == ESTALE || (error == ENOENT && dircache_gone(anc->fd))) {
+            dircache_drop(anc);
+            fd = open(path, DIRCACHE_OPEN);
+        } else {
+            errno = error;
+        }
+    }
+
+    if (fd == -1) return -1;
+
+    /* Without room in the cache, the descriptor is handed out uncached */
+    if (!dircache_evict() || !(e = mem_alloc(sizeof(*e) + len + 1)))
+        return fd;
+
+    e->hash = hash, e->len = len, e->fd = fd, e->refs = 1, e->stale = false;
+    memcpy(e->path, path, len + 1);
+
+    e->chain = dircache.buckets[hash & (DIRCACHE_BUCKETS - 1)];
+    dircache.buckets[hash & (DIRCACHE_BUCKETS - 1)] = e;
+    e->prev = e->next = NULL;
+    dircache_front(e);
+    ++dircache.count;
+
+    return fd;
+}
+
+int exio_dircache_get(const char *path)
+{
+    struct scratch_mark mark = scratch_mark();
+
+    char  *canon;
+    size_t len;
+    int    fd = -1;
+
+    if (!(canon = scratch_alloc(PATH_MAX + 1))) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    if (!(len = path_canon(canon, path))) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    pthread_mutex_lock(&dircache.lock);
+    fd = dircache_acquire(canon, len);
+    pthread_mutex_unlock(&dircache.lock);
+
+out:
+    scratch_release(mark);
+    return fd;
+}
+
+void exio_dircache_put(int fd)
+{
+    struct dir_entry *e, **p;
+
+    if (fd < 0) return;
+
+    pthread_mutex_lock(&dircache.lock);
+
+    for (e = dircache.head; e && e->fd != fd; e = e->next);
+
+    if (e) {
+        --e->refs;
+        if (dircache.count > dircache.max) dircache_evict();
+    } else {
+        /* Either invalidated while referenced, or handed out uncached */
+        for (p = &dircache.stale; *p && (*p)->fd != fd; p = &(*p)->next);
+
+        if (!(e = *p)) {
+            close(fd);
+        } else if (--e->refs == 0) {
+            *p = e->next;
+            close(e->fd);
+            mem_free(e);
+        }
+    }
+
+    pthread_mutex_unlock(&dircache.lock);
+}
+
+void exio_dircache_invalidate(const char *path)
+{
+    struct scratch_mark mark = scratch_mark();
+    struct dir_entry   *e, *next;
+
+    char  *canon;
+    size_t len;
+
+    if (!(canon = scratch_alloc(PATH_MAX + 1))
+        || !(len = path_canon(canon, path)))
+        goto out;
+
+    pthread_mutex_lock(&dircache.lock);
+
+    /* Descendants are invalidated too, as they may have moved with 'path' */
+    for (e = dircache.head; e; e = next) {
+        next = e->next;
+
+        if (e->len >= len && memcmp(e->path, canon, len) == 0
+            && (e->len == len || e->path[len] == '/' || len == 1))
+            dircache_drop(e);
+    }
+
+    pthread_mutex_unlock(&dircache.lock);
+
+out:
+    scratch_release(mark);
+}
+
+void exio_dircache_limit(size_t max_fds)
+{
+    pthread_mutex_lock(&dircache.lock);
+    dircache.max = max_fds;
+    dircache_evict();
+    pthread_mutex_unlock(&dircache.lock);
+}
+
+/* Get a descriptor for the cached parent directory of 'path' and set 'name' to
+   the last component of the path, or get 'AT_FDCWD' and set 'name' to 'path'
+   itself if 'path' is not a canonical absolute path. The descriptor is
+   released with 'path_release()'. */
+static int path_parent(const char *path, const char **name)
+{
+    struct scratch_mark mark = scratch_mark();
+
+    char  *canon;
+    size_t len;
+    int    fd = AT_FDCWD;
+
+    *name = path;
+
+    if (!(canon = scratch_alloc(PATH_MAX + 1))
+        || !(len = path_canon(canon, path)) || len == 1 || !STR_EQ(canon, path))
+        goto out;
+
+    while (canon[--len] != '/');
+    canon[len ? len : 1] = '\0';
+
+    pthread_mutex_lock(&dircache.lock);
+    fd = dircache_acquire(canon, len ? len : 1);
+    pthread_mutex_unlock(&dircache.lock);
+
+    if (fd == -1) {
+        fd = AT_FDCWD;
+        goto out;
+    }
+
+    *name = path + len + 1;
+
+out:
+    scratch_release(mark);
+    return fd;
+}
+
+static void path_release(int dirfd)
+{
+    if (dirfd != AT_FDCWD) exio_dircache_put(dirfd);
+}
+
+/* Invalidate the cached parent 'dirfd' of 'path' if an operation relative to
+   it failed because the directory is gone. Returns true if the operation should
+   be retried with 'path' itself. */
+static bool path_stale(int dirfd, const char *path)
+{
+    struct scratch_mark mark;
+
+    char *parent;
+    int   error = errno;
+
+    if (dirfd == AT_FDCWD || (error != ENOENT && error != ESTALE)
+        || !dircache_gone(dirfd))
+        return false;
+
+    mark = scratch_mark();
+
+    if ((parent = scratch_alloc(PATH_MAX + 1)) && path_canon(parent, path)) {
+        *strrchr(parent, '/') = '\0';
+        exio_dircache_invalidate(*parent ? parent : "/");
+    }
+
+    scratch_release(mark);
+    errno = error;
+    return true;
+}
+
+/* 'open()' with 'path' resolved from its cached parent directory. */
+static int path_open(const char *path, int flags, mode_t mode)
+{
+    const char *name;
+    int dirfd = path_parent(path, &name), fd, error;
+
+    if ((fd = openat(dirfd, name, flags, mode)) == -1 && path_stale(dirfd, path))
+        fd = open(path, flags, mode);
+
+    error = errno;
+    path_release(dirfd);
+    errno = error;
+
+    return fd;
+}
+
+/* Allocate 'size' bytes of memory which is locked into RAM, excluded from core
+   dumps and not inherited by children. The size of the mapping is stored in a
+   header preceding the returned memory. */
+static void *secure_alloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t map_sz = (size + SECURE_HDR + page - 1) & ~(page - 1);
+    char  *map;
+
+    map = mmap(NULL, map_sz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    if (mlock(map, map_sz) != 0) {
+        munmap(map, map_sz);
+        return NULL;
+    }
+
+    /* These are protective measures only, so failure is not fatal */
+#ifdef MADV_DONTDUMP
+    madvise(map, map_sz, MADV_DONTDUMP);
+#endif
+#ifdef MADV_WIPEONFORK
+    madvise(map, map_sz, MADV_WIPEONFORK);
+#endif
+
+    memcpy(map, &map_sz, sizeof(map_sz));
+    return map + SECURE_HDR;
+}
+
+static void secure_free(void *ptr)
+{
+    char  *map = (char *) ptr - SECURE_HDR;
+    size_t map_sz;
+
+    if (!ptr) return;
+
+    memcpy(&map_sz, map, sizeof(map_sz));
+    explicit_bzero(map, map_sz);
+    munlock(map, map_sz);
+    munmap(map, map_sz);
+}
+
+char *exio_read_secret_fd(int fd, size_t *secret_len)
+{
+    off_t   size = fsize(fd);
+    size_t  cap, len = 0;
+    ssize_t n;
+    char   *buf;
+    int     saved;
+
+    /* Files with a size are read up to it, which takes a single read, as
+       probing for growth would cost a second one. Pipes and other streams are
+       read until EOF, up to a fixed capacity. */
+    cap = (size > 0) ? (size_t) size : SECRET_MAX;
+    if (!(buf = secure_alloc(cap + 1))) return NULL;
+
+    while (len < cap && (n = read(fd, buf + len, cap - len)) != 0) {
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) goto fail;
+        len += n;
+    }
+
+    if (size <= 0 && len == cap) {
+        errno = EFBIG;
+        goto fail;
+    }
+
+    // Ignore the trailing newline
+    if (len > 0 && buf[len - 1] == '\n') --len;
+
+    buf[len] = '\0';
+    if (secret_len) *secret_len = len;
+
+    return buf;
+
+fail:
+    saved = errno;
+    secure_free(buf);
+    errno = saved;
+    return NULL;
+}
+
+char *exio_read_secret(const char *path, size_t *secret_len)
+{
+    char *secret;
+    int   fd, saved;
+
+    if ((fd = path_open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY, 0)) == -1)
+        return NULL;
+
+    secret = exio_read_secret_fd(fd, secret_len);
+
+    saved = errno;
+    close(fd);
+    errno = saved;
+
+    return secret;
+}
+
+void exio_free_secret(char *secret)
+{
+    secure_free(secret);
+}
+
+/* Join the 'n' components in 'parts' with '/' characters into 'path', which
+   has room for 'PATH_MAX' characters. */
+static bool path_join(char *restrict path, const char *const *parts, size_t n)
+{
+    size_t len = 0, part_len, i;
+
+    for (i = 0; i < n; ++i) {
+        part_len = strlen(parts[i]);
+
+        // Take the '/' character to be added into account
+        if (len + part_len + !!i > PATH_MAX) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+
+        if (i) path[len++] = '/';
+        memcpy(path + len, parts[i], part_len);
+        len += part_len;
+    }
+
+    path[len] = '\0';
+    return true;
+}
+
+int get_xdg_path(char *restrict path, const char *sub_dir,
+                 const char *xdg_dir, const char *fallback_dir)
+{
+    const char *parts[3];
+
+    if ((parts[0] = getenv(xdg_dir))) {
+        parts[1] = sub_dir;
+        return path_join(path, parts, 2) ? 0 : -1;
+    } else if ((parts[0] = getenv("HOME"))) {
+        parts[1] = fallback_dir, parts[2] = sub_dir;
+        return path_join(path, parts, 3) ? 0 : -1;
+    } else {
+        return -2;
+    }
+}
+
+bool mkpathat(int dirfd, char *path)
+{
+    char *path_iter;
+
+    /* The directories are created with permissions 0777 - umask, yielding
+       standard permissions. Error 'EEXIST' is acceptable because the path or
+       part of it may already exist, which we are expected to ignore. */
+    for (path_iter = path + 1; *path_iter; ++path_iter) {
+        if (*path_iter != '/') continue;
+        *path_iter = '\0';      /* Temporarily truncate */
+
+        if (mkdirat(dirfd, path, S_IRWXU | S_IRWXG | S_IRWXO) != 0
+            && errno != EEXIST) {
+            *path_iter = '/';
+            return false;
+        }
+
+        *path_iter = '/';
+    }
+
+    if (mkdirat(dirfd, path, S_IRWXU | S_IRWXG | S_IRWXO) != 0
+        && errno != EEXIST)
+        return false;
+
+    return true;
+}
+
+bool mkpath(char *path)
+{
+    const char *name;
+    int dirfd = path_parent(path, &name), error;
+    bool ret;
+
+    /* Most of the time the parent exists, so try creating the last directory
+       from the cached parent before walking the entire path */
+    ret = mkdirat(dirfd, name, S_IRWXU | S_IRWXG | S_IRWXO) == 0
+          || errno == EEXIST;
+
+    if (!ret && (errno == ENOENT || errno == ESTALE)) {
+        path_stale(dirfd, path);
+        ret = mkpathat(AT_FDCWD, path);
+    }
+
+    error = errno;
+    path_release(dirfd);
+    errno = error;
+
+    return ret;
+}
+
+off_t fsize(int fd)
+{
+    struct stat st;
+
+    /* We do not use 'fseek()' or 'ftello()' because 'SEEK_END' with binary data
+       is not standard C. */
+    return (fstat(fd, &st) == 0) ? st.st_size : -1;
+}
+
+struct pool;
+
+/* A task for the thread pool. */
+struct pool_task {
+    void (*func)(struct pool *pool, void *arg);
+    void  *arg;
+};
+
+/* Each worker owns a deque of tasks, from which it takes the newest task while
+   idle workers steal the oldest. Tasks submitted by a task are pushed onto the
+   deque of its worker, so that related work tends to stay on one thread. */
+struct pool_worker {
+    pthread_mutex_t   lock;
+    struct pool_task *tasks;            // Ring buffer
+    size_t            head, len, cap;
+    pthread_t         thread;
+    struct pool      *pool;
+};
+
+struct pool {
+    struct pool_worker *workers;
+    size_t              nworkers;
+    size_t              next;           // Worker for external submissions
+    size_t              pending;        // Tasks submitted but not finished
+    unsigned            seq;            // Incremented on submission
+    unsigned            sleepers;
+    pthread_mutex_t     idle_lock;
+    pthread_cond_t      idle_cond;
+    int                 error;          // First error encountered
+};
+
+static __thread struct pool_worker *pool_self;
+
+static unsigned online_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/* Create a pool of 'nthreads' workers, or one per online CPU if 0. The pool
+   does not run until 'pool_run()'. */
+static struct pool *pool_new(unsigned nthreads)
+{
+    struct pool *pool;
+    size_t i;
+
+    if (!nthreads) nthreads = online_cpus();
+
+    if (!(pool = mem_calloc(1, sizeof(*pool)))) return NULL;
+
+    if (!(pool->workers = mem_calloc(nthreads, sizeof(*pool->workers)))) {
+        mem_free(pool);
+        return NULL;
+    }
+
+    pool->nworkers = nthreads;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (i = 0; i < nthreads; ++i) {
+        pthread_mutex_init(&pool->workers[i].lock, NULL);
+        pool->workers[i].pool = pool;
+    }
+
+    return pool;
+}
+
+static void pool_wake(struct pool *pool)
+{
+    __atomic_add_fetch(&pool->seq, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+/* Record 'error' as the result of the pool, unless an error was already
+   recorded. The remaining tasks still run. */
+static void pool_fail(struct pool *pool, int error)
+{
+    int none = 0;
+
+    __atomic_compare_exchange_n(&pool->error, &none, error, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static bool pool_failed(struct pool *pool)
+{
+    return __atomic_load_n(&pool->error, __ATOMIC_RELAXED) != 0;
+}
+
+static bool pool_submit(struct pool *pool,
+                        void (*func)(struct pool *pool, void *arg), void *arg)
+{
+    struct pool_worker *w = pool_self;
+    struct pool_task   *tasks;
+    size_t i, j;
+
+    if (!w || w->pool != pool) {
+        i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        w = &pool->workers[i % pool->nworkers];
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->len == w->cap) {
+        i = w->cap ? w->cap * 2 : POOL_DEQUE_MIN;
+
+        if (!(tasks = mem_alloc(i * sizeof(*tasks)))) {
+            pthread_mutex_unlock(&w->lock);
+            pool_fail(pool, ENOMEM);
+            return false;
+        }
+
+        /* Unwrap the ring into the new buffer */
+        for (j = 0; j < w->len; ++j)
+            tasks[j] = w->tasks[(w->head + j) % w->cap];
+
+        mem_free(w->tasks);
+        w->tasks = tasks, w->head = 0, w->cap = i;
+    }
+
+    w->tasks[(w->head + w->len++) % w->cap] = (struct pool_task) { func, arg };
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&w->lock);
+
+    pool_wake(pool);
+    return true;
+}
+
+/* Take a task from the back of the deque of 'w' if 'own', or from the front
+   otherwise. */
+static bool pool_take(struct pool_worker *w, bool own, struct pool_task *task)
+{
+    bool ret = false;
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->len) {
+        if (own) {
+            *task = w->tasks[(w->head + --w->len) % w->cap];
+        } else {
+            *task = w->tasks[w->head];
+            w->head = (w->head + 1) % w->cap;
+            --w->len;
+        }
+
+        ret = true;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+static bool pool_find(struct pool_worker *self, struct pool_task *task)
+{
+    struct pool *pool = self->pool;
+    size_t id = self - pool->workers, i;
+
+    if (pool_take(self, true, task)) return true;
+
+    for (i = 1; i < pool->nworkers; ++i) {
+        if (pool_take(&pool->workers[(id + i) % pool->nworkers], false, task))
+            return true;
+    }
+
+    return false;
+}
+
+static void *pool_work(void *arg)
+{
+    struct pool_worker *self = arg;
+    struct pool        *pool = self->pool;
+    struct pool_task    task;
+    unsigned            seq;
+
+    pool_self = self;
+
+    for (;;) {
+        /* Read the sequence before looking for work, so that a submission
+           made after a fruitless search prevents sleeping */
+        seq = __atomic_load_n(&pool->seq, __ATOMIC_SEQ_CST);
+
+        if (pool_find(self, &task)) {
+            task.func(pool, task.arg);
+
+            if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0)
+                pool_wake(pool);
+
+            continue;
+        }
+
+        if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) break;
+
+        pthread_mutex_lock(&pool->idle_lock);
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+
+        while (__atomic_load_n(&pool->seq, __ATOMIC_SEQ_CST) == seq
+               && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) != 0)
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+
+    pool_self = NULL;
+    return NULL;
+}
+
+/* Run the pool until all submitted tasks (including those submitted by tasks)
+   have finished, using the calling thread as one of the workers. The pool is
+   freed afterwards. Returns 0 or the first error recorded. */
+static int pool_run(struct pool *pool)
+{
+    size_t started, i;
+    int    ret;
+
+    for (started = 1; started < pool->nworkers; ++started) {
+        /* Fewer threads just means less parallelism */
+        if (pthread_create(&pool->workers[started].thread, NULL, pool_work,
+                           &pool->workers[started]) != 0)
+            break;
+    }
+
+    pool_work(&pool->workers[0]);
+
+    for (i = 1; i < started; ++i)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (i = 0; i < pool->nworkers; ++i) {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        mem_free(pool->workers[i].tasks);
+    }
+
+    ret = pool->error;
+
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    mem_free(pool->workers);
+    mem_free(pool);
+
+    return ret;
+}
+
+/* State shared by the tasks of 'exio_copy_tree()'. */
+struct copy_tree {
+    int              src, dst;          // Root directories
+    int              flags;
+    pthread_mutex_t  lock;
+    struct tree_node *dirs;             // Directories awaiting their metadata
+    size_t            ndirs;
+};
+
+/* A file or directory in a tree walk, at 'path' relative to the roots. */
+struct tree_node {
+    void             *tree;
+    struct tree_node *next;
+    struct timespec   times[2];
+    uint64_t          state;            // Specific to the walk
+    char              path[];
+};
+
+static struct tree_node *tree_node_new(void *tree,
+                                       const char *dir, const char *name)
+{
+    struct tree_node *node;
+    size_t dir_len = strcmp(dir, ".") ? strlen(dir) : 0;
+    size_t name_len = strlen(name);
+
+    // Take the '/' character and null terminator into account
+    if (!(node = mem_alloc(sizeof(*node) + dir_len + name_len + 2))) return NULL;
+
+    node->tree = tree;
+    node->next = NULL;
+
+    if (dir_len) {
+        memcpy(node->path, dir, dir_len);
+        node->path[dir_len++] = '/';
+    }
+
+    memcpy(node->path + dir_len, name, name_len + 1);
+    return node;
+}
+
+/* Copy the contents of 'in' to 'out', which are 'size' bytes long. Cloning and
+   in-kernel copying are preferred to reading and writing. */
+static bool copy_data(int in, int out, off_t size)
+{
+    char    buf[COPY_BUF];
+    ssize_t n, done, w;
+
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) return true;
+#endif
+
+    while (size > 0 && (n = copy_file_range(in, NULL, out, NULL, size, 0)) > 0)
+        size -= n;
+
+    if (size <= 0) return true;
+
+    /* Not every file system supports 'copy_file_range()', so fall back to a
+       manual copy. Nothing has been copied if the first call failed. */
+    if (n == -1 && errno != EXDEV && errno != EINVAL && errno != ENOSYS
+        && errno != EOPNOTSUPP)
+        return false;
+
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return false;
+
+        for (done = 0; done < n; ) {
+            w = write(out, buf + done, n - done);
+
+            if (w == -1 && errno == EINTR) continue;
+            if (w == -1) return false;
+            done += w;
+        }
+    }
+
+    return true;
+}
+
+/* Apply the ownership, permissions and times of 'st' to 'fd'. Failure to
+   change the owner is expected without privileges, and ignored. */
+static bool copy_meta(int fd, const struct stat *st)
+{
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+    if (fchown(fd, st->st_uid, st->st_gid) != 0 && errno != EPERM)
+        return false;
+
+    return fchmod(fd, st->st_mode & 07777) == 0 && futimens(fd, times) == 0;
+}
+
+static void copy_file(struct pool *pool, void *arg)
+{
+    struct tree_node *node = arg;
+    struct copy_tree *tree = node->tree;
+    struct stat st;
+
+    int in, out = -1;
+
+    in = openat(tree->src, node->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in == -1 || fstat(in, &st) != 0) goto fail;
+
+    out = openat(tree->dst, node->path,
+                 O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                 (tree->flags & COPY_META) ? st.st_mode & 07777 : 0666);
+
+    if (out == -1 || !copy_data(in, out, st.st_size)) goto fail;
+    if ((tree->flags & COPY_META) && !copy_meta(out, &st)) goto fail;
+
+    goto out;
+
+fail:
+    pool_fail(pool, errno);
+
+out:
+    if (in != -1) close(in);
+    if (out != -1) close(out);
+    mem_free(node);
+}
+
+/* Write a temporary name in the directory of 'path' into 'tmp', which holds
+   'PATH_MAX + 1' bytes. The names are unique within the process, but may be
+   left behind by an earlier one, so callers take the next name on EEXIST. */
+static void tmp_name(char *tmp, const char *path)
+{
+    static unsigned seq;
+
+    const char *base = strrchr(path, '/');
+
+    snprintf(tmp, PATH_MAX + 1, "%.*s.exio-%ld-%u",
+             base ? (int) (base - path + 1) : 0, path, (long) getpid(),
+             __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+}
+
+/* Atomically replace 'path' under 'dirfd' with a link to 'target', through a
+   temporary link in the same directory. */
+static bool link_replace(int dirfd, const char *path, const char *target)
+{
+    char tmp[PATH_MAX + 1];
+    int  ret;
+
+    do {
+        tmp_name(tmp, path);
+    } while ((ret = symlinkat(target, dirfd, tmp)) != 0 && errno == EEXIST);
+
+    if (ret != 0) return false;
+
+    if (renameat(dirfd, tmp, dirfd, path) != 0) {
+        unlinkat(dirfd, tmp, 0);
+        return false;
+    }
+
+    return true;
+}
+
+static bool copy_link(struct copy_tree *tree, const char *path)
+{
+    char            target[PATH_MAX + 1], old[PATH_MAX + 1];
+    struct stat     st;
+    struct timespec times[2];
+    ssize_t         len, old_len;
+
+    if ((len = readlinkat(tree->src, path, target, PATH_MAX)) == -1)
+        return false;
+
+    target[len] = '\0';
+
+    /* An existing link is only kept if it has the same target */
+    if (symlinkat(target, tree->dst, path) != 0) {
+        if (errno != EEXIST) return false;
+
+        old_len = readlinkat(tree->dst, path, old, PATH_MAX);
+        if ((old_len != len || memcmp(target, old, len) != 0)
+            && !link_replace(tree->dst, path, target))
+            return false;
+    }
+
+    if (!(tree->flags & COPY_META)) return true;
+
+    if (fstatat(tree->src, path, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return false;
+
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+
+    if (fchownat(tree->dst, path, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0
+        && errno != EPERM)
+        return false;
+
+    return utimensat(tree->dst, path, times, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+static void copy_dir(struct pool *pool, void *arg)
+{
+    struct tree_node *node = arg, *child;
+    struct copy_tree *tree = node->tree;
+    struct dirent    *ent;
+    struct stat       st;
+
+    DIR *dir = NULL;
+    int  fd, type;
+
+    fd = openat(tree->src, node->path,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd == -1 || !(dir = fdopendir(fd))) {
+        if (fd != -1) close(fd);
+        pool_fail(pool, errno);
+        goto out;
+    }
+
+    while ((errno = 0, ent = readdir(dir))) {
+        if (STR_EQ(ent->d_name, ".") || STR_EQ(ent->d_name, ".."))
+            continue;
+
+        /* The type is only unknown on some file systems */
+        type = ent->d_type;
+        if (type == DT_UNKNOWN || ((tree->flags & COPY_META) && type == DT_DIR)) {
+            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                pool_fail(pool, errno);
+                continue;
+            }
+
+            type = S_ISDIR(st.st_mode) ? DT_DIR
+                 : S_ISREG(st.st_mode) ? DT_REG
+                 : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+        }
+
+        if (!(child = tree_node_new(tree, node->path, ent->d_name))) {
+            pool_fail(pool, errno);
+            break;
+        }
+
+        switch (type) {
+        case DT_REG:
+            if (!pool_submit(pool, copy_file, child)) mem_free(child);
+            continue;
+
+        case DT_DIR:
+            /* With the metadata, the directory is only given its mode once
+               filled, as it may not be writable */
+            if (mkdirat(tree->dst, child->path, (tree->flags & COPY_META)
+                        ? S_IRWXU : 0777) != 0 && errno != EEXIST) {
+                pool_fail(pool, errno);
+                break;
+            }
+
+            if (tree->flags & COPY_META) {
+                /* The mode and times are applied once the contents are
+                   complete */
+                child->times[0] = st.st_atim;
+                child->times[1] = st.st_mtim;
+                child->state = st.st_mode & 07777;
+
+                if (fchownat(tree->dst, child->path, st.st_uid, st.st_gid, 0) != 0
+                    && errno != EPERM)
+                    pool_fail(pool, errno);
+            }
+
+            if (!pool_submit(pool, copy_dir, child)) break;
+            continue;
+
+        case DT_LNK:
+            if (!copy_link(tree, child->path)) pool_fail(pool, errno);
+            break;
+
+        default:
+            /* Special files are not copied */
+            break;
+        }
+
+        mem_free(child);
+    }
+
+    if (errno) pool_fail(pool, errno);
+    closedir(dir);
+
+out:
+    if ((tree->flags & COPY_META) && strcmp(node->path, ".")) {
+        pthread_mutex_lock(&tree->lock);
+        node->next = tree->dirs;
+        tree->dirs = node;
+        ++tree->ndirs;
+        pthread_mutex_unlock(&tree->lock);
+    } else {
+        mem_free(node);
+    }
+}
+
+static size_t path_depth(const char *path)
+{
+    size_t depth = 0;
+
+    while ((path = strchr(path, '/'))) ++path, ++depth;
+    return depth;
+}
+
+/* Deeper directories first. */
+static int copy_dir_cmp(const void *a, const void *b)
+{
+    size_t da = path_depth((*(struct tree_node *const *) a)->path);
+    size_t db = path_depth((*(struct tree_node *const *) b)->path);
+
+    return (da < db) - (da > db);
+}
+
+/* Apply the mode and times of the copied directory 'node'. */
+static bool copy_dir_meta(const struct copy_tree *tree,
+                          const struct tree_node *node)
+{
+    return fchmodat(tree->dst, node->path, node->state, 0) == 0
+           && utimensat(tree->dst, node->path, node->times,
+                        AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+bool exio_copy_tree(const char *src, const char *dst, int flags,
+                    unsigned nthreads)
+{
+    struct copy_tree  tree = { -1, -1, flags, PTHREAD_MUTEX_INITIALIZER,
+                               NULL, 0 };
+    struct tree_node *root, *next, **dirs;
+    struct pool      *pool = NULL;
+    struct stat       st;
+
+    char   dst_path[PATH_MAX + 1];
+    size_t i;
+    int    error = 0;
+
+    if (strlen(dst) > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    strcpy(dst_path, dst);
+
+    tree.src = path_open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (tree.src == -1 || !mkpathat(AT_FDCWD, dst_path)) goto fail;
+
+    tree.dst = path_open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (tree.dst == -1) goto fail;
+
+    if (!(pool = pool_new(nthreads)) || !(root = tree_node_new(&tree, ".", ".")))
+        goto fail;
+
+    if (!pool_submit(pool, copy_dir, root)) {
+        mem_free(root);
+        goto fail;
+    }
+
+    error = pool_run(pool);
+    pool = NULL;
+
+    /* Writing into the directories changed their times, so they are set last,
+       from the deepest so that a restrictive mode cannot bar the way */
+    if (tree.ndirs && (dirs = mem_alloc(tree.ndirs * sizeof(*dirs)))) {
+        for (i = 0, root = tree.dirs; root; root = root->next) dirs[i++] = root;
+        qsort(dirs, tree.ndirs, sizeof(*dirs), copy_dir_cmp);
+
+        for (i = 0; i < tree.ndirs; ++i) {
+            if (!copy_dir_meta(&tree, dirs[i]) && !error) error = errno;
+            mem_free(dirs[i]);
+        }
+
+        mem_free(dirs);
+    } else {
+        if (tree.ndirs && !error) error = errno;
+
+        for (root = tree.dirs; root; root = next) {
+            next = root->next;
+            mem_free(root);
+        }
+    }
+
+    if ((flags & COPY_META) && !error) {
+        if (fstat(tree.src, &st) != 0 || !copy_meta(tree.dst, &st))
+            error = errno;
+    }
+
+    goto out;
+
+fail:
+    error = errno;
+
+out:
+    /* A pool which never ran must still be torn down */
+    if (pool) pool_run(pool);
+    if (tree.src != -1) close(tree.src);
+    if (tree.dst != -1) close(tree.dst);
+    pthread_mutex_destroy(&tree.lock);
+
+    errno = error;
+    return !error;
+}
+
+/* The attributes of a file compared by 'exio_mirror()'. */
+struct file_info {
+    mode_t          mode;
+    uid_t           uid;
+    gid_t           gid;
+    off_t           size;
+    struct timespec mtime;
+};
+
+struct mirror_tree {
+    int                   src, dst;     // Root directories
+    int                   flags;
+    struct mirror_summary sum;          // Updated atomically
+    pthread_mutex_t       lock;
+    struct tree_node     *dirs;         // Directories awaiting their mode
+    size_t                ndirs;
+};
+
+/* Set in the state of a directory whose mode is applied once it is filled,
+   along with that mode. */
+#define MIRROR_SET_MODE     ((uint64_t) 1 << 32)
+
+/* An entry of a destination directory, marked if present in the source. */
+struct mirror_ent {
+    char *name;
+    bool  seen;
+};
+
+static bool stat_at(int dirfd, const char *path, struct file_info *fi)
+{
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+
+    if (statx(dirfd, path, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+              STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE
+              | STATX_MTIME, &stx) != 0)
+        return false;
+
+    fi->mode = stx.stx_mode;
+    fi->uid = stx.stx_uid;
+    fi->gid = stx.stx_gid;
+    fi->size = stx.stx_size;
+    fi->mtime.tv_sec = stx.stx_mtime.tv_sec;
+    fi->mtime.tv_nsec = stx.stx_mtime.tv_nsec;
+#else
+    struct stat st;
+
+    if (fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) != 0) return false;
+
+    fi->mode = st.st_mode;
+    fi->uid = st.st_uid;
+    fi->gid = st.st_gid;
+    fi->size = st.st_size;
+    fi->mtime = st.st_mtim;
+#endif
+
+    return true;
+}
+
+static void mirror_count(size_t *count, off_t bytes, struct mirror_tree *tree)
+{
+    __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tree->sum.bytes, (uint64_t) bytes, __ATOMIC_RELAXED);
+}
+
+/* Remove 'path' relative to 'dirfd', recursively if it is a directory. */
+static bool remove_at(int dirfd, const char *path)
+{
+    struct dirent *ent;
+    DIR *dir;
+    int  fd;
+    bool ret = true;
+
+    if (unlinkat(dirfd, path, 0) == 0) return true;
+    if (errno != EISDIR && errno != EPERM) return false;
+
+    fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    if (!(dir = fdopendir(fd))) {
+        close(fd);
+        return false;
+    }
+
+    while (ret && (ent = readdir(dir))) {
+        if (!STR_EQ(ent->d_name, ".") && !STR_EQ(ent->d_name, ".."))
+            ret = remove_at(fd, ent->d_name);
+    }
+
+    closedir(dir);
+    return ret && unlinkat(dirfd, path, AT_REMOVEDIR) == 0;
+}
+
+/* Whether the regular files 'path' in both trees have the same contents. */
+static bool same_contents(struct mirror_tree *tree, const char *path,
+                          off_t size)
+{
+    char    a[COPY_BUF / 2], b[COPY_BUF / 2];
+    ssize_t n;
+    off_t   off;
+    int     fa, fb;
+    bool    ret = false;
+
+    fa = openat(tree->src, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    fb = openat(tree->dst, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fa == -1 || fb == -1) goto out;
+
+    for (off = 0; off < size; off += n) {
+        n = pread(fa, a, sizeof(a), off);
+        if (n <= 0 || pread(fb, b, n, off) != n || memcmp(a, b, n)) goto out;
+    }
+
+    ret = true;
+
+out:
+    if (fa != -1) close(fa);
+    if (fb != -1) close(fb);
+    return ret;
+}
+
+/* Atomically replace 'path' in the destination tree with the source file,
+   through a temporary file in the same directory. */
+static bool mirror_file(struct mirror_tree *tree, const char *path,
+                        off_t *copied)
+{
+    char        tmp[PATH_MAX + 1];
+    struct stat st;
+    int         in, out = -1;
+    bool        ret = false;
+
+    in = openat(tree->src, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in == -1 || fstat(in, &st) != 0) goto out;
+
+    do {
+        tmp_name(tmp, path);
+        out = openat(tree->dst, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                     st.st_mode & 07777);
+    } while (out == -1 && errno == EEXIST);
+
+    if (out == -1) goto out;
+
+    /* The times are always preserved, because they are used for comparison */
+    if (!copy_data(in, out, *copied = fsize(in))
+        || ((tree->flags & MIRROR_META) ? !copy_meta(out, &st)
+            : futimens(out, (struct timespec[2]) { st.st_atim, st.st_mtim })))
+        goto out;
+
+    ret = renameat(tree->dst, tmp, tree->dst, path) == 0;
+
+out:
+    if (out != -1) {
+        close(out);
+        if (!ret) unlinkat(tree->dst, tmp, 0);
+    }
+
+    if (in != -1) close(in);
+    return ret;
+}
+
+static bool mirror_link(struct mirror_tree *tree, const char *path,
+                        bool *changed)
+{
+    char    target[PATH_MAX + 1], old[PATH_MAX + 1];
+    ssize_t len, old_len;
+
+    if ((len = readlinkat(tree->src, path, target, PATH_MAX)) == -1)
+        return false;
+
+    old_len = readlinkat(tree->dst, path, old, PATH_MAX);
+    if (!(*changed = old_len != len || memcmp(target, old, len) != 0))
+        return true;
+
+    target[len] = '\0';
+    return link_replace(tree->dst, path, target);
+}
+
+static int mirror_ent_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct mirror_ent *) a)->name,
+                  ((const struct mirror_ent *) b)->name);
+}
+
+/* Read the names in directory 'path' of the destination tree, sorted. */
+static struct mirror_ent *mirror_list(struct mirror_tree *tree,
+                                      const char *path, size_t *len)
+{
+    struct mirror_ent *ents = NULL, *new;
+    struct dirent     *ent;
+
+    size_t cap = 0;
+    DIR   *dir;
+    int    fd;
+
+    *len = 0;
+
+    fd = openat(tree->dst, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1 || !(dir = fdopendir(fd))) {
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (STR_EQ(ent->d_name, ".") || STR_EQ(ent->d_name, ".."))
+            continue;
+
+        if (*len == cap) {
+            cap = cap ? cap * 2 : 16;
+            if (!(new = mem_realloc(ents, cap * sizeof(*ents)))) break;
+            ents = new;
+        }
+
+        if (!(ents[*len].name = mem_strdup(ent->d_name))) break;
+        ents[(*len)++].seen = false;
+    }
+
+    closedir(dir);
+    if (*len) qsort(ents, *len, sizeof(*ents), mirror_ent_cmp);
+
+    return ents;
+}
+
+/* Create the directory 'node' in the destination tree if 'dst' (its current
+   attributes) is NULL. With the metadata, its owner is synced with 'src' now,
+   and its mode once it is filled, as it must stay writable until then. */
+static bool mirror_mkdir(struct mirror_tree *tree, struct tree_node *node,
+                         const struct file_info *src,
+                         const struct file_info *dst)
+{
+    bool meta = tree->flags & MIRROR_META;
+
+    if (!dst && mkdirat(tree->dst, node->path, meta ? S_IRWXU : 0777) != 0
+        && errno != EEXIST)
+        return false;
+
+    if (!meta) return true;
+
+    if ((!dst || dst->uid != src->uid || dst->gid != src->gid)
+        && fchownat(tree->dst, node->path, src->uid, src->gid,
+                    AT_SYMLINK_NOFOLLOW) != 0
+        && errno != EPERM)
+        return false;
+
+    if (dst && (dst->mode & 07777) == (src->mode & 07777)
+        && (dst->mode & S_IRWXU) == S_IRWXU)
+        return true;
+
+    /* An existing directory which is not writable is opened up meanwhile */
+    if (dst && (dst->mode & S_IRWXU) != S_IRWXU
+        && fchmodat(tree->dst, node->path, (dst->mode & 07777) | S_IRWXU,
+                    0) != 0)
+        return false;
+
+    node->state = MIRROR_SET_MODE | (src->mode & 07777);
+    return true;
+}
+
+static void mirror_dir(struct pool *pool, void *arg)
+{
+    struct tree_node   *node = arg, *child = NULL;
+    struct mirror_tree *tree = node->tree;
+    struct mirror_ent  *ents, key, *found;
+    struct file_info    src, dst;
+    struct dirent      *ent;
+
+    size_t len, i;
+    off_t  copied;
+    DIR   *dir = NULL;
+    int    fd;
+    bool   exists, changed;
+
+    ents = mirror_list(tree, node->path, &len);
+
+    fd = openat(tree->src, node->path,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd == -1 || !(dir = fdopendir(fd))) {
+        if (fd != -1) close(fd);
+        pool_fail(pool, errno);
+        goto out;
+    }
+
+    while ((errno = 0, ent = readdir(dir))) {
+        if (STR_EQ(ent->d_name, ".") || STR_EQ(ent->d_name, ".."))
+            continue;
+
+        mem_free(child);
+        if (!(child = tree_node_new(tree, node->path, ent->d_name))) {
+            pool_fail(pool, errno);
+            break;
+        }
+
+        key.name = ent->d_name;
+        found = len ? bsearch(&key, ents, len, sizeof(*ents), mirror_ent_cmp)
+                    : NULL;
+        if (found) found->seen = true;
+
+        if (!stat_at(fd, ent->d_name, &src)) {
+            pool_fail(pool, errno);
+            continue;
+        }
+
+        exists = found && stat_at(tree->dst, child->path, &dst);
+
+        /* Entries which changed type are replaced entirely */
+        if (exists && (src.mode & S_IFMT) != (dst.mode & S_IFMT)) {
+            if (!remove_at(tree->dst, child->path)) {
+                pool_fail(pool, errno);
+                continue;
+            }
+
+            exists = false;
+        }
+
+        if (S_ISDIR(src.mode)) {
+            if (!mirror_mkdir(tree, child, &src, exists ? &dst : NULL)) {
+                pool_fail(pool, errno);
+                continue;
+            }
+
+            if (!exists) mirror_count(&tree->sum.created, 0, tree);
+            if (pool_submit(pool, mirror_dir, child)) child = NULL;
+        } else if (S_ISREG(src.mode)) {
+            if (exists && src.size == dst.size
+                && ((tree->flags & MIRROR_CONTENT)
+                    ? same_contents(tree, child->path, src.size)
+                    : (src.mtime.tv_sec == dst.mtime.tv_sec
+                       && src.mtime.tv_nsec == dst.mtime.tv_nsec))) {
+                mirror_count(&tree->sum.unchanged, 0, tree);
+                continue;
+            }
+
+            if (!mirror_file(tree, child->path, &copied))
+                pool_fail(pool, errno);
+            else
+                mirror_count(exists ? &tree->sum.updated : &tree->sum.created,
+                             copied, tree);
+        } else if (S_ISLNK(src.mode)) {
+            if (!mirror_link(tree, child->path, &changed))
+                pool_fail(pool, errno);
+            else if (changed)
+                mirror_count(exists ? &tree->sum.updated : &tree->sum.created,
+                             0, tree);
+            else
+                mirror_count(&tree->sum.unchanged, 0, tree);
+        }
+    }
+
+    if (errno) pool_fail(pool, errno);
+    closedir(dir);
+
+    /* Whatever was not found in the source is extraneous */
+    for (i = 0; i < len; ++i) {
+        if (ents[i].seen || (tree->flags & MIRROR_KEEP)) continue;
+
+        mem_free(child);
+        if (!(child = tree_node_new(tree, node->path, ents[i].name))
+            || !remove_at(tree->dst, child->path))
+            pool_fail(pool, errno);
+        else
+            mirror_count(&tree->sum.deleted, 0, tree);
+    }
+
+out:
+    for (i = 0; i < len; ++i) mem_free(ents[i].name);
+    mem_free(ents);
+    mem_free(child);
+
+    if (node->state & MIRROR_SET_MODE) {
+        pthread_mutex_lock(&tree->lock);
+        node->next = tree->dirs;
+        tree->dirs = node;
+        ++tree->ndirs;
+        pthread_mutex_unlock(&tree->lock);
+    } else {
+        mem_free(node);
+    }
+}
+
+/* Apply the modes of the directories filled by 'exio_mirror()', from the
+   deepest so that a restrictive mode cannot bar the way. Returns 0 on success,
+   or the first error. */
+static int mirror_dir_modes(struct mirror_tree *tree)
+{
+    struct tree_node *node, *next, **dirs;
+
+    size_t i;
+    int    error = 0;
+
+    if (!tree->ndirs) return 0;
+
+    if (!(dirs = mem_alloc(tree->ndirs * sizeof(*dirs)))) {
+        for (node = tree->dirs; node; node = next) {
+            next = node->next;
+            mem_free(node);
+        }
+
+        return errno;
+    }
+
+    for (i = 0, node = tree->dirs; node; node = node->next) dirs[i++] = node;
+    qsort(dirs, tree->ndirs, sizeof(*dirs), copy_dir_cmp);
+
+    for (i = 0; i < tree->ndirs; ++i) {
+        if (fchmodat(tree->dst, dirs[i]->path, dirs[i]->state & 07777, 0) != 0
+            && !error)
+            error = errno;
+
+        mem_free(dirs[i]);
+    }
+
+    mem_free(dirs);
+    return error;
+}
+
+bool exio_mirror(const char *src, const char *dst, int flags,
+                 struct mirror_summary *summary, unsigned nthreads)
+{
+    struct mirror_tree tree;
+    struct tree_node  *root;
+    struct pool       *pool = NULL;
+    struct file_info   src_fi, dst_fi;
+
+    char dst_path[PATH_MAX + 1];
+    int  error = 0, error2;
+
+    if (strlen(dst) > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    memset(&tree, 0, sizeof(tree));
+    tree.src = tree.dst = -1;
+    tree.flags = flags;
+    pthread_mutex_init(&tree.lock, NULL);
+
+    strcpy(dst_path, dst);
+
+    tree.src = path_open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (tree.src == -1 || !mkpathat(AT_FDCWD, dst_path)) goto fail;
+
+    tree.dst = path_open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (tree.dst == -1) goto fail;
+
+    if (!(pool = pool_new(nthreads)) || !(root = tree_node_new(&tree, ".", ".")))
+        goto fail;
+
+    /* The root is synced like any other directory */
+    if (stat_at(tree.src, ".", &src_fi) && stat_at(tree.dst, ".", &dst_fi)
+        && mirror_mkdir(&tree, root, &src_fi, &dst_fi)
+        && pool_submit(pool, mirror_dir, root)) {
+        error = pool_run(pool);
+        if ((error2 = mirror_dir_modes(&tree)) && !error) error = error2;
+        goto out;
+    }
+
+    mem_free(root);
+
+fail:
+    error = errno;
+    if (pool) pool_run(pool);
+
+out:
+    if (tree.src != -1) close(tree.src);
+    if (tree.dst != -1) close(tree.dst);
+    if (summary) *summary = tree.sum;
+    pthread_mutex_destroy(&tree.lock);
+
+    errno = error;
+    return !error;
+}
+
+/* Output of a chunk of 'exio_par_lines()', written in order of the chunks. */
+struct line_out {
+    char   *buf;
+    size_t  len, cap;
+};
+
+struct par_lines {
+    const char        *data;
+    size_t             nchunks;
+    struct par_chunk  *chunks;
+    bool             (*func)(const char *line, size_t len,
+                             struct line_out *out, void *arg);
+    void              *arg;
+    int                out_fd;
+    pthread_mutex_t    out_lock;
+    size_t             out_next;        // First chunk not yet written
+};
+
+struct par_chunk {
+    struct par_lines *par;
+    size_t            start, end;
+    bool              done;
+    struct line_out   out;
+};
+
+bool exio_line_out(struct line_out *out, const void *data, size_t len)
+{
+    char  *buf;
+    size_t cap;
+
+    if (out->len + len > out->cap) {
+        for (cap = out->cap ? out->cap : 4096; cap < out->len + len; cap *= 2);
+
+        if (!(buf = mem_realloc(out->buf, cap))) return false;
+        out->buf = buf, out->cap = cap;
+    }
+
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+
+    return true;
+}
+
+/* Write the output of every finished chunk that follows the written ones. */
+static void par_flush(struct pool *pool, struct par_lines *par)
+{
+    struct par_chunk *c;
+
+    pthread_mutex_lock(&par->out_lock);
+
+    while (par->out_next < par->nchunks && (c = &par->chunks[par->out_next])->done) {
+        if (!write_all(par->out_fd, c->out.buf, c->out.len))
+            pool_fail(pool, errno);
+
+        mem_free(c->out.buf);
+        c->out.buf = NULL;
+        ++par->out_next;
+    }
+
+    pthread_mutex_unlock(&par->out_lock);
+}
+
+static void par_chunk(struct pool *pool, void *arg)
+{
+    struct par_chunk *c = arg;
+    struct par_lines *par = c->par;
+    struct line_out  *out = (par->out_fd != -1) ? &c->out : NULL;
+
+    const char *line = par->data + c->start, *end = par->data + c->end, *nl;
+
+    for (; line < end && !pool_failed(pool); line = nl + 1) {
+        /* 'memchr()' is vectorised by any reasonable C library */
+        if (!(nl = memchr(line, '\n', end - line))) nl = end;
+
+        errno = 0;
+        if (!par->func(line, nl - line, out, par->arg)) {
+            pool_fail(pool, errno ? errno : ECANCELED);
+            break;
+        }
+    }
+
+    if (!out) return;
+
+    __atomic_store_n(&c->done, true, __ATOMIC_RELEASE);
+    par_flush(pool, par);
+}
+
+bool exio_par_lines(const char *path, unsigned nthreads,
+                    bool (*func)(const char *line, size_t len,
+                                 struct line_out *out, void *arg),
+                    void *arg, int out_fd)
+{
+    struct par_lines par;
+    struct pool     *pool;
+
+    const char *nl;
+    size_t      size, i, pos;
+    off_t       len;
+    void       *map = MAP_FAILED;
+    int         fd, error = 0;
+
+    if ((fd = path_open(path, O_RDONLY | O_CLOEXEC, 0)) == -1) return false;
+    if ((len = fsize(fd)) == -1) goto fail;
+    if (len == 0) goto out;
+
+    size = len;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) goto fail;
+
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    if (!(pool = pool_new(nthreads))) goto fail;
+
+    memset(&par, 0, sizeof(par));
+    par.data = map, par.func = func, par.arg = arg, par.out_fd = out_fd;
+    pthread_mutex_init(&par.out_lock, NULL);
+
+    par.nchunks = pool->nworkers * PAR_CHUNKS;
+    if (size / par.nchunks < PAR_CHUNK_MIN)
+        par.nchunks = size / PAR_CHUNK_MIN + 1;
+
+    if (!(par.chunks = mem_calloc(par.nchunks, sizeof(*par.chunks)))) {
+        error = errno;
+        pool_run(pool);
+        goto out;
+    }
+
+    /* Split the file evenly, then move each split forward to the start of the
+       next line, so that no line is shared between chunks */
+    for (i = 0, pos = 0; i < par.nchunks; ++i) {
+        par.chunks[i].par = &par;
+        par.chunks[i].start = pos;
+
+        pos = (i == par.nchunks - 1) ? size : (i + 1) * (size / par.nchunks);
+        if (pos < par.chunks[i].start) pos = par.chunks[i].start;
+
+        if (pos > 0 && pos < size && par.data[pos - 1] != '\n') {
+            nl = memchr(par.data + pos, '\n', size - pos);
+            pos = nl ? (size_t) (nl - par.data) + 1 : size;
+        }
+
+        par.chunks[i].end = pos;
+    }
+
+    for (i = 0; i < par.nchunks; ++i) {
+        if (!pool_submit(pool, par_chunk, &par.chunks[i])) break;
+    }
+
+    error = pool_run(pool);
+
+    for (i = 0; i < par.nchunks; ++i)
+        mem_free(par.chunks[i].out.buf);
+
+    mem_free(par.chunks);
+    pthread_mutex_destroy(&par.out_lock);
+    goto out;
+
+fail:
+    error = errno;
+
+out:
+    if (map != MAP_FAILED) munmap(map, size);
+    close(fd);
+
+    errno = error;
+    return !error;
+}
+
+/* A watched file system, identified by its device. The lowest admitted
+   priority is derived from the free space whenever it is refreshed, so that
+   checking admission is a single atomic load. */
+struct fs_entry {
+    dev_t          dev;
+    int            fd;
+    uint64_t       shed, refuse;        // Thresholds in bytes
+    struct statvfs st;
+    struct timespec stamp;              // Time of the last refresh
+    int            admit;               // Lowest admitted 'enum fs_prio'
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    struct fs_entry entries[FSINFO_MAX];
+    size_t          count;              // Published with release semantics
+    unsigned        interval;
+    bool            started;
+} fsinfo = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { { 0 } }, 0,
+             FSINFO_INTERVAL, false };
+
+/* Refresh the free space of 'e'. Must be called with the lock held. */
+static bool fs_refresh(struct fs_entry *e)
+{
+    struct statvfs st;
+    uint64_t       avail;
+    int            admit;
+
+    if (fstatvfs(e->fd, &st) != 0) return false;
+
+    avail = (uint64_t) st.f_bavail * st.f_frsize;
+    admit = avail < e->refuse ? PRIO_HIGH
+          : avail < e->shed   ? PRIO_NORMAL
+          :                     PRIO_LOW;
+
+    e->st = st;
+    clock_gettime(CLOCK_MONOTONIC, &e->stamp);
+    __atomic_store_n(&e->admit, admit, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+static void *fs_work(void *arg)
+{
+    size_t i;
+
+    (void) arg;
+    pthread_mutex_lock(&fsinfo.lock);
+
+    for (;;) {
+        if (fsinfo.interval)
+            cond_wait_ns(&fsinfo.cond, &fsinfo.lock,
+                         (uint64_t) fsinfo.interval * 1000000);
+        else
+            pthread_cond_wait(&fsinfo.cond, &fsinfo.lock);
+
+        /* Failure leaves the previous state, which is the best guess */
+        for (i = 0; i < fsinfo.count; ++i)
+            fs_refresh(&fsinfo.entries[i]);
+    }
+
+    return NULL;
+}
+
+/* Find the watched file system on the device 'dev', or return -1. */
+static int fs_lookup(dev_t dev)
+{
+    size_t n = __atomic_load_n(&fsinfo.count, __ATOMIC_ACQUIRE), i;
+
+    for (i = 0; i < n; ++i)
+        if (fsinfo.entries[i].dev == dev) return i;
+
+    return -1;
+}
+
+int exio_fs_watch(const char *path, uint64_t shed_below, uint64_t refuse_below)
+{
+    struct fs_entry *e;
+    struct stat      st;
+    pthread_t        thread;
+
+    int fd, fs = -1, error = 0;
+
+#ifdef O_PATH
+    fd = open(path, O_PATH | O_CLOEXEC);
+#else
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd == -1) return -1;
+
+    if (fstat(fd, &st) != 0) {
+        error = errno;
+        goto out;
+    }
+
+    pthread_mutex_lock(&fsinfo.lock);
+
+    if ((fs = fs_lookup(st.st_dev)) != -1) {
+        e = &fsinfo.entries[fs];
+    } else if (fsinfo.count < FSINFO_MAX) {
+        e = &fsinfo.entries[fsinfo.count];
+        e->dev = st.st_dev;
+        e->fd = fd;
+    } else {
+        error = ENOSPC;
+        goto unlock;
+    }
+
+    e->shed = shed_below;
+    e->refuse = refuse_below;
+
+    if (!fs_refresh(e)) {
+        error = errno;
+        goto unlock;
+    }
+
+    /* Only a new entry keeps the descriptor */
+    if (fs == -1) {
+        fs = fsinfo.count, fd = -1;
+        __atomic_store_n(&fsinfo.count, fsinfo.count + 1, __ATOMIC_RELEASE);
+    }
+
+    /* The thread lives as long as the process, as watches are never removed */
+    if (!fsinfo.started && pthread_create(&thread, NULL, fs_work, NULL) == 0) {
+        pthread_detach(thread);
+        fsinfo.started = true;
+    }
+
+unlock:
+    pthread_mutex_unlock(&fsinfo.lock);
+
+out:
+    if (fd != -1) close(fd);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    return fs;
+}
+
+int exio_fs_find(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) return -1;
+    return fs_lookup(st.st_dev);
+}
+
+/* Whether 'fs' identifies a watched file system. */
+static bool fs_valid(int fs)
+{
+    return (size_t) fs < __atomic_load_n(&fsinfo.count, __ATOMIC_ACQUIRE);
+}
+
+bool exio_fs_admit(int fs, enum fs_prio prio)
+{
+    if (fs < 0) return true;
+
+    if (EXIO_UNLIKELY(!fs_valid(fs))) {
+        errno = EINVAL;
+        return false;
+    }
+
+    return (int) prio >= __atomic_load_n(&fsinfo.entries[fs].admit,
+                                         __ATOMIC_RELAXED);
+}
+
+bool exio_fs_info(int fs, struct fs_info *info, bool refresh)
+{
+    struct fs_entry *e;
+    struct timespec  now;
+
+    bool ret = true;
+
+    if (fs < 0 || !fs_valid(fs)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    e = &fsinfo.entries[fs];
+    pthread_mutex_lock(&fsinfo.lock);
+
+    if (refresh) ret = fs_refresh(e);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    info->size = (uint64_t) e->st.f_blocks * e->st.f_frsize;
+    info->avail = (uint64_t) e->st.f_bavail * e->st.f_frsize;
+    info->files = e->st.f_files;
+    info->files_avail = e->st.f_favail;
+    info->age_ms = (now.tv_sec - e->stamp.tv_sec) * 1000
+                 + (now.tv_nsec - e->stamp.tv_nsec) / 1000000;
+
+    pthread_mutex_unlock(&fsinfo.lock);
+    return ret;
+}
+
+void exio_fs_interval(unsigned ms)
+{
+    pthread_mutex_lock(&fsinfo.lock);
+    fsinfo.interval = ms;
+    pthread_cond_signal(&fsinfo.cond);
+    pthread_mutex_unlock(&fsinfo.lock);
+}
+
+/* A file writer with two buffers: one is filled by the caller while the other
+   is written by a background thread. */
+struct exio_writer {
+    int              fd;
+    int              flags;
+    size_t           buf_sz;
+    char            *bufs[2];
+    int              cur;               // Buffer being filled
+    size_t           fill;
+    off_t            size;              // Logical size of the file
+    int              fs;                // Watched file system, or -1
+    pthread_t        thread;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    const char      *pending;           // Buffer being written
+    size_t           pending_len;
+    bool             stop;
+    int              error;
+};
+
+static void *writer_work(void *arg)
+{
+    struct exio_writer *w = arg;
+
+    const char *buf;
+    size_t      len;
+    bool        ok;
+
+    pthread_mutex_lock(&w->lock);
+
+    for (;;) {
+        while (!w->pending && !w->stop)
+            pthread_cond_wait(&w->cond, &w->lock);
+
+        if (!w->pending) break;
+
+        buf = w->pending, len = w->pending_len;
+        pthread_mutex_unlock(&w->lock);
+
+        ok = write_all(w->fd, buf, len);
+
+        pthread_mutex_lock(&w->lock);
+        if (!ok && !w->error) w->error = errno;
+        w->pending = NULL;
+        pthread_cond_broadcast(&w->cond);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* Wait for the buffer in flight to be written. Returns false if writing
+   failed, with the first error in errno. */
+static bool writer_wait(struct exio_writer *w)
+{
+    int error;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->pending) pthread_cond_wait(&w->cond, &w->lock);
+    error = w->error;
+    pthread_mutex_unlock(&w->lock);
+
+    if (error) errno = error;
+    return !error;
+}
+
+/* Hand the first 'len' bytes of the current buffer to the background thread,
+   and switch to the other buffer. */
+static bool writer_submit(struct exio_writer *w, size_t len)
+{
+    if (!writer_wait(w)) return false;
+
+    pthread_mutex_lock(&w->lock);
+    w->pending = w->bufs[w->cur];
+    w->pending_len = len;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    w->cur ^= 1;
+    return true;
+}
+
+struct exio_writer *exio_writer_open(const char *path, int flags,
+                                     size_t buf_sz, off_t prealloc)
+{
+    struct exio_writer *w;
+    struct stat         st;
+
+    int open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int error;
+
+    if (!(w = mem_calloc(1, sizeof(*w)))) return NULL;
+
+    w->flags = flags;
+    w->buf_sz = buf_sz ? (buf_sz + WRITER_ALIGN - 1) & ~(size_t) (WRITER_ALIGN - 1)
+                       : WRITER_BUF;
+
+#ifdef O_DIRECT
+    if (flags & WRITER_DIRECT) {
+        /* Not every file system supports direct IO */
+        w->fd = path_open(path, open_flags | O_DIRECT, 0666);
+
+        if (w->fd == -1 && errno == EINVAL)
+            w->flags &= ~WRITER_DIRECT;
+        else if (w->fd == -1)
+            goto fail_free;
+    }
+#else
+    w->flags &= ~WRITER_DIRECT;
+#endif
+
+    if (!(w->flags & WRITER_DIRECT)
+        && (w->fd = path_open(path, open_flags, 0666)) == -1)
+        goto fail_free;
+
+    w->fs = fstat(w->fd, &st) == 0 ? fs_lookup(st.st_dev) : -1;
+
+    /* Preallocation is an optimisation, so failure is not fatal */
+    if (prealloc > 0) {
+#ifdef FALLOC_FL_KEEP_SIZE
+        fallocate(w->fd, FALLOC_FL_KEEP_SIZE, 0, prealloc);
+#else
+        posix_fallocate(w->fd, 0, prealloc);
+#endif
+    }
+
+    if (!(w->bufs[0] = mem_alloc_aligned(WRITER_ALIGN, w->buf_sz))
+        || !(w->bufs[1] = mem_alloc_aligned(WRITER_ALIGN, w->buf_sz)))
+        goto fail_close;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    if ((errno = pthread_create(&w->thread, NULL, writer_work, w))) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        goto fail_close;
+    }
+
+    return w;
+
+fail_close:
+    error = errno;
+    mem_free(w->bufs[0]);
+    mem_free(w->bufs[1]);
+    close(w->fd);
+    errno = error;
+
+fail_free:
+    mem_free(w);
+    return NULL;
+}
+
+bool exio_writer_write(struct exio_writer *w, const void *data, size_t len)
+{
+    size_t n;
+
+    enum fs_prio prio = (w->flags & WRITER_LOW) ? PRIO_LOW : PRIO_NORMAL;
+
+    if (EXIO_UNLIKELY(!exio_fs_admit(w->fs, prio))) {
+        errno = ENOSPC;
+        return false;
+    }
+
+    while (len > 0) {
+        n = w->buf_sz - w->fill;
+        if (n > len) n = len;
+
+        memcpy(w->bufs[w->cur] + w->fill, data, n);
+        w->fill += n, w->size += n;
+        data = (const char *) data + n, len -= n;
+
+        if (w->fill == w->buf_sz) {
+            if (!writer_submit(w, w->buf_sz)) return false;
+            w->fill = 0;
+        }
+    }
+
+    return true;
+}
+
+bool exio_writer_flush(struct exio_writer *w)
+{
+    size_t len = w->fill, tail = 0;
+
+    /* Direct IO can only write whole blocks, so the partial block at the end is
+       kept for later */
+    if (w->flags & WRITER_DIRECT) {
+        tail = len % WRITER_ALIGN;
+        len -= tail;
+    }
+
+    /* Only a submission swaps the buffers; otherwise the partial block is
+       already at the start of the current one */
+    if (len) {
+        if (!writer_submit(w, len)) return false;
+        if (tail) memcpy(w->bufs[w->cur], w->bufs[w->cur ^ 1] + len, tail);
+    }
+
+    w->fill = tail;
+
+    return writer_wait(w);
+}
+
+bool exio_writer_close(struct exio_writer *w)
+{
+    size_t len = w->fill;
+    bool   ret;
+    int    error;
+
+    /* The final block is padded for direct IO, and the padding truncated */
+    if (w->flags & WRITER_DIRECT) {
+        len = (len + WRITER_ALIGN - 1) & ~(size_t) (WRITER_ALIGN - 1);
+        memset(w->bufs[w->cur] + w->fill, 0, len - w->fill);
+    }
+
+    ret = (!len || writer_submit(w, len)) && writer_wait(w);
+    error = ret ? 0 : errno;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    if (ret && (w->flags & WRITER_DIRECT) && len != w->fill
+        && ftruncate(w->fd, w->size) != 0)
+        ret = false, error = errno;
+
+    if (ret && (w->flags & WRITER_SYNC) && fdatasync(w->fd) != 0)
+        ret = false, error = errno;
+
+    if (close(w->fd) != 0 && ret) ret = false, error = errno;
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    mem_free(w->bufs[0]);
+    mem_free(w->bufs[1]);
+    mem_free(w);
+
+    if (!ret) errno = error;
+    return ret;
+}
+
+/* The first page of a mapped log, which is shared by every process appending to
+   it. 'tail' is the length of the data reserved so far. */
+struct maplog_hdr {
+    uint64_t magic;
+    uint64_t tail;
+};
+
+struct exio_maplog {
+    int                fd;
+    char              *base;            // Reserved for the largest log
+    char              *data;            // Past the header
+    size_t             window, max;
+    size_t             mapped;          // Length of the data mapped so far
+    struct maplog_hdr *hdr;
+    pthread_mutex_t    lock;
+};
+
+/* Extend the file 'fd' to at least 'size' bytes, which other processes may be
+   doing at the same time. */
+static bool maplog_grow(int fd, off_t size)
+{
+    struct stat st;
+
+#ifdef __linux__
+    /* Allocating the blocks keeps a full disk from raising 'SIGBUS' later */
+    if (fallocate(fd, 0, 0, size) == 0) return true;
+    if (errno != EOPNOTSUPP) return false;
+#endif
+
+    if (fstat(fd, &st) != 0) return false;
+    return st.st_size >= size || ftruncate(fd, size) == 0;
+}
+
+/* Map the windows of 'l' up to the end of the data 'end'. */
+static bool maplog_map(struct exio_maplog *l, size_t end)
+{
+    size_t len;
+    bool   ret = true;
+
+    pthread_mutex_lock(&l->lock);
+
+    if (end > l->mapped) {
+        len = (end + l->window - 1) / l->window * l->window;
+        if (len > l->max) len = l->max;
+
+        /* The new window is mapped in place, so the earlier ones never move
+           under other threads */
+        if (!maplog_grow(l->fd, MAPLOG_HDR + len)
+            || mmap(l->data + l->mapped, len - l->mapped,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                    l->fd, MAPLOG_HDR + l->mapped) == MAP_FAILED)
+            ret = false;
+        else
+            __atomic_store_n(&l->mapped, len, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&l->lock);
+    return ret;
+}
+
+struct exio_maplog *exio_maplog_open(const char *path, size_t window,
+                                     size_t max)
+{
+    struct exio_maplog *l;
+    struct stat         st;
+
+    long     page = sysconf(_SC_PAGESIZE);
+    uint64_t magic = MAPLOG_MAGIC;
+    int      error;
+
+    if (page <= 0 || MAPLOG_HDR % page != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!(l = mem_calloc(1, sizeof(*l)))) return NULL;
+
+    l->window = window ? (window + page - 1) / page * page : MAPLOG_WINDOW;
+    l->max = max ? max : MAPLOG_MAX;
+
+    if ((l->fd = path_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) == -1)
+        goto fail_free;
+
+    if (fstat(l->fd, &st) != 0) goto fail_close;
+
+    /* Only an empty file is formatted, by writing the magic before it is grown;
+       processes racing to format it write the same bytes. Anything else must
+       already be a log, and is left untouched otherwise. */
+    if (st.st_size == 0) {
+        if (pwrite(l->fd, &magic, sizeof(magic), 0) != (ssize_t) sizeof(magic))
+            goto fail_close;
+    } else if (pread(l->fd, &magic, sizeof(magic), 0) != (ssize_t) sizeof(magic)
+               || magic != MAPLOG_MAGIC) {
+        errno = EINVAL;
+        goto fail_close;
+    }
+
+    if (!maplog_grow(l->fd, MAPLOG_HDR)) goto fail_close;
+
+    /* Address space is reserved for the whole log up front, and windows of the
+       file are mapped into it as it grows */
+    l->base = mmap(NULL, MAPLOG_HDR + l->max, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (l->base == MAP_FAILED) goto fail_close;
+
+    if (mmap(l->base, MAPLOG_HDR, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, l->fd, 0) == MAP_FAILED)
+        goto fail_unmap;
+
+    l->hdr = (struct maplog_hdr *) l->base;
+    l->data = l->base + MAPLOG_HDR;
+
+    pthread_mutex_init(&l->lock, NULL);
+    return l;
+
+fail_unmap:
+    error = errno;
+    munmap(l->base, MAPLOG_HDR + l->max);
+    errno = error;
+
+fail_close:
+    error = errno;
+    close(l->fd);
+    errno = error;
+
+fail_free:
+    mem_free(l);
+    return NULL;
+}
+
+bool exio_maplog_append(struct exio_maplog *l, const void *data, size_t len)
+{
+    uint64_t off = __atomic_fetch_add(&l->hdr->tail, len, __ATOMIC_RELAXED);
+
+    if (EXIO_UNLIKELY(off + len > l->max)) {
+        errno = ENOSPC;
+        return false;
+    }
+
+    if (EXIO_UNLIKELY(off + len > __atomic_load_n(&l->mapped, __ATOMIC_ACQUIRE))
+        && !maplog_map(l, off + len))
+        return false;
+
+    memcpy(l->data + off, data, len);
+    return true;
+}
+
+bool exio_maplog_sync(struct exio_maplog *l)
+{
+    uint64_t tail = __atomic_load_n(&l->hdr->tail, __ATOMIC_RELAXED);
+    size_t   mapped = __atomic_load_n(&l->mapped, __ATOMIC_ACQUIRE);
+
+    if (tail > mapped) tail = mapped;
+
+    return msync(l->base, MAPLOG_HDR + tail, MS_SYNC) == 0;
+}
+
+bool exio_maplog_close(struct exio_maplog *l)
+{
+    bool ret = true;
+    int  error = 0;
+
+    if (munmap(l->base, MAPLOG_HDR + l->max) != 0) ret = false, error = errno;
+    if (close(l->fd) != 0 && ret) ret = false, error = errno;
+
+    pthread_mutex_destroy(&l->lock);
+    mem_free(l);
+
+    if (!ret) errno = error;
+    return ret;
+}
+
+/* The header of a journal record, followed by the text padded to 8 bytes. A sync
+   marker has 'JOURNAL_MAGIC' as its text. */
+struct journal_rec {
+    uint32_t len;                       // Of the text
+    uint32_t crc;                       // Of the rest of the record, and 'len'
+    uint64_t time_ns;
+    uint32_t type;                      // 'enum msg_level' or 'JOURNAL_SYNC_TYPE'
+    uint32_t pid;
+};
+
+struct exio_journal {
+    int             fd;
+    off_t           size;
+    off_t           sync;               // Position of the last sync marker
+    pthread_mutex_t lock;
+};
+
+#define JOURNAL_ALIGN(len)  (((len) + 7) & ~(size_t) 7)
+
+static uint32_t journal_crc(const struct journal_rec *rec, const void *text)
+{
+    uint32_t crc = exio_crc32c(0, &rec->len, sizeof(rec->len));
+
+    crc = exio_crc32c(crc, &rec->time_ns, sizeof(*rec) - 8);
+    return exio_crc32c(crc, text, rec->len);
+}
+
+/* Validate the record at 'pos' in the 'size' bytes of 'map', and copy its
+   header to 'rec'. Returns the length of the record, or 0 if it is invalid. */
+static size_t journal_check(const char *map, size_t size, size_t pos,
+                            struct journal_rec *rec)
+{
+    if (size - pos < sizeof(*rec)) return 0;
+
+    memcpy(rec, map + pos, sizeof(*rec));
+
+    if (rec->len > size - pos - sizeof(*rec)
+        || JOURNAL_ALIGN(rec->len) > size - pos - sizeof(*rec)
+        || journal_crc(rec, map + pos + sizeof(*rec)) != rec->crc)
+        return 0;
+
+    return sizeof(*rec) + JOURNAL_ALIGN(rec->len);
+}
+
+static bool journal_is_sync(const char *map, const struct journal_rec *rec,
+                            size_t pos)
+{
+    uint64_t magic;
+
+    if (rec->type != JOURNAL_SYNC_TYPE || rec->len != sizeof(magic))
+        return false;
+
+    memcpy(&magic, map + pos + sizeof(*rec), sizeof(magic));
+    return magic == JOURNAL_MAGIC;
+}
+
+/* Find the next sync marker after the invalid record at 'pos', which is aligned
+   like every record. Returns its position, or 'size' if there is none. */
+static size_t journal_resync(const char *map, size_t size, size_t pos)
+{
+    struct journal_rec rec;
+
+    /* The CRC is only computed where the header and text look like a marker */
+    for (pos += 8; pos + sizeof(rec) + sizeof(uint64_t) <= size; pos += 8) {
+        memcpy(&rec, map + pos, sizeof(rec));
+
+        if (journal_is_sync(map, &rec, pos)
+            && journal_check(map, size, pos, &rec))
+            return pos;
+    }
+
+    return size;
+}
+
+/* Build a record of 'type' with 'len' bytes of 'text' at 'buf'. Returns the
+   length of the record. */
+static size_t journal_build(char *buf, uint32_t type, const void *text,
+                            size_t len)
+{
+    struct journal_rec rec;
+    struct timespec    ts;
+
+    size_t total = sizeof(rec) + JOURNAL_ALIGN(len);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    rec.len = len;
+    rec.time_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec.type = type;
+    rec.pid = getpid();
+    rec.crc = journal_crc(&rec, text);
+
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), text, len);
+    memset(buf + sizeof(rec) + len, 0, total - sizeof(rec) - len);
+
+    return total;
+}
+
+/* Find the length of the valid start of the journal 'fd', which is 'size' bytes
+   long, and the position of its last sync marker. */
+static bool journal_recover(int fd, size_t size, off_t *valid, off_t *sync)
+{
+    struct journal_rec rec;
+
+    const char *map;
+    size_t      pos = 0, next, n;
+    uint32_t    len = sizeof(uint64_t);
+    uint64_t    magic = JOURNAL_MAGIC;
+
+    *valid = *sync = 0;
+    if (size == 0) return true;
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return false;
+
+    /* A file which does not start with a sync marker is not a journal, unless
+       that marker is what was torn */
+    if (memcmp(map, &len, size < sizeof(len) ? size : sizeof(len)) != 0
+        || (size >= sizeof(rec) + sizeof(magic)
+            && memcmp(map + sizeof(rec), &magic, sizeof(magic)) != 0)) {
+        munmap((void *) map, size);
+        errno = EINVAL;
+        return false;
+    }
+
+    madvise((void *) map, size, MADV_SEQUENTIAL);
+
+    /* Every record is checked in a single pass over the mapping. Damage
+       followed by a sync marker is left for readers to skip, so the scan only
+       stops at a torn record at the end */
+    while (pos < size) {
+        if ((n = journal_check(map, size, pos, &rec))) {
+            if (journal_is_sync(map, &rec, pos)) *sync = pos;
+            pos += n;
+        } else if ((next = journal_resync(map, size, pos)) < size) {
+            pos = next;
+        } else {
+            break;
+        }
+    }
+
+    munmap((void *) map, size);
+    *valid = pos;
+    return true;
+}
+
+struct exio_journal *exio_journal_open(const char *path)
+{
+    struct exio_journal *j;
+
+    uint64_t magic = JOURNAL_MAGIC;
+    char     buf[sizeof(struct journal_rec) + sizeof(magic)];
+    off_t    size;
+    int      error;
+
+    if (!(j = mem_calloc(1, sizeof(*j)))) return NULL;
+
+    if ((j->fd = path_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) == -1)
+        goto fail_free;
+
+    /* Recovery truncates the file, which must not happen under another
+       writer */
+    if (flock(j->fd, LOCK_EX | LOCK_NB) != 0) goto fail_close;
+
+    if ((size = fsize(j->fd)) == -1
+        || !journal_recover(j->fd, size, &j->size, &j->sync))
+        goto fail_close;
+
+    if (j->size != size && ftruncate(j->fd, j->size) != 0) goto fail_close;
+
+    if (j->size == 0) {
+        if (!write_all(j->fd, buf,
+                       journal_build(buf, JOURNAL_SYNC_TYPE, &magic,
+                                     sizeof(magic))))
+            goto fail_close;
+
+        j->size = sizeof(buf);
+    }
+
+    pthread_mutex_init(&j->lock, NULL);
+    return j;
+
+fail_close:
+    error = errno;
+    close(j->fd);
+    errno = error;
+
+fail_free:
+    mem_free(j);
+    return NULL;
+}
+
+bool exio_journal_write(struct exio_journal *j, enum msg_level level,
+                        const char *text, size_t len)
+{
+    struct scratch_mark mark;
+
+    uint64_t magic = JOURNAL_MAGIC;
+    size_t   n = 0, done;
+    ssize_t  r;
+    char    *buf;
+    bool     ret = true;
+
+    if (len > UINT32_MAX) {
+        errno = EINVAL;
+        return false;
+    }
+
+    mark = scratch_mark();
+
+    if (!(buf = scratch_alloc(2 * sizeof(struct journal_rec) + sizeof(magic)
+                              + JOURNAL_ALIGN(len)))) {
+        scratch_release(mark);
+        return false;
+    }
+
+    pthread_mutex_lock(&j->lock);
+
+    /* The marker goes in the same write as the record which crosses into the
+       next stretch */
+    if (j->size - j->sync >= JOURNAL_SYNC)
+        n = journal_build(buf, JOURNAL_SYNC_TYPE, &magic, sizeof(magic));
+
+    n += journal_build(buf + n, level, text, len);
+
+    /* A partial write is overwritten by the next record, and a crash during one
+       leaves a torn record for recovery to cut off */
+    for (done = 0; done < n; ) {
+        r = pwrite(j->fd, buf + done, n - done, j->size + done);
+
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) {
+            ret = false;
+            break;
+        }
+
+        done += r;
+    }
+
+    if (ret) {
+        if (n > sizeof(struct journal_rec) + JOURNAL_ALIGN(len))
+            j->sync = j->size;
+
+        j->size += n;
+    }
+
+    pthread_mutex_unlock(&j->lock);
+    scratch_release(mark);
+
+    return ret;
+}
+
+bool exio_journal_sync(struct exio_journal *j)
+{
+    return fdatasync(j->fd) == 0;
+}
+
+bool exio_journal_close(struct exio_journal *j)
+{
+    bool ret = close(j->fd) == 0;
+
+    pthread_mutex_destroy(&j->lock);
+    mem_free(j);
+
+    return ret;
+}
+
+bool exio_journal_read(const char *path,
+                       bool (*func)(const struct journal_entry *entry,
+                                    void *arg),
+                       void *arg)
+{
+    struct journal_entry entry;
+    struct journal_rec   rec;
+
+    const char *map;
+    size_t      size, pos = 0, n;
+    off_t       len;
+    int         fd, error = 0;
+    bool        ret = true;
+
+    if ((fd = path_open(path, O_RDONLY | O_CLOEXEC, 0)) == -1) return false;
+
+    if ((len = fsize(fd)) <= 0) {
+        error = errno;
+        close(fd);
+        errno = error;
+        return len == 0;
+    }
+
+    size = len;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    error = errno;
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        errno = error;
+        return false;
+    }
+
+    madvise((void *) map, size, MADV_SEQUENTIAL);
+
+    while (pos < size) {
+        if (!(n = journal_check(map, size, pos, &rec))) {
+            pos = journal_resync(map, size, pos);
+            continue;
+        }
+
+        if (!journal_is_sync(map, &rec, pos)) {
+            entry.level = rec.type;
+            entry.time_ns = rec.time_ns;
+            entry.pid = rec.pid;
+            entry.text = map + pos + sizeof(rec);
+            entry.len = rec.len;
+
+            if (!func(&entry, arg)) {
+                ret = false;
+                break;
+            }
+        }
+
+        pos += n;
+    }
+
+    munmap((void *) map, size);
+    return ret;
+}
+
+static bool journal_export(const struct journal_entry *entry, void *arg)
+{
+    static const char *const prefs[] = {
+        [LEVEL_ERROR]   = C_ERROR PREF_ERROR C_NORMAL,
+        [LEVEL_WARNING] = C_WARNING PREF_WARNING C_NORMAL,
+        [LEVEL_INFO]    = C_INFO PREF_INFO C_NORMAL
+    };
+
+    FILE *out = arg;
+
+    /* Records of unknown levels from newer versions are still shown */
+    const char *pref = (unsigned) entry->level < ARRAY_LEN(prefs)
+                       ? prefs[entry->level] : "";
+
+    return fputs(pref, out) != EOF
+           && fwrite(entry->text, 1, entry->len, out) == entry->len
+           && fputc('\n', out) != EOF;
+}
+
+bool exio_journal_export(const char *path, FILE *out)
+{
+    return exio_journal_read(path, journal_export, out) && fflush(out) == 0;
+}
+
+/* Slicing-by-8 tables for computing CRC32C without hardware support. */
+static uint32_t       crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_resolve(uint32_t crc, const unsigned char *p,
+                               size_t len);
+
+/* The implementation in use, which is resolved by the first call. */
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len)
+    = crc32c_resolve;
+
+static void crc32c_init_table(void)
+{
+    uint32_t crc;
+    size_t   i, j;
+
+    for (i = 0; i < 256; ++i) {
+        for (crc = i, j = 0; j < 8; ++j)
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+
+        crc32c_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; ++i) {
+        for (j = 1; j < 8; ++j) {
+            crc = crc32c_table[j - 1][i];
+            crc32c_table[j][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xff];
+        }
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t v;
+    size_t   i;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        /* Load in little-endian order regardless of the host */
+        for (v = 0, i = 8; i-- > 0; )
+            v = (v << 8) | p[i];
+
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff]
+            ^ crc32c_table[6][(v >> 8) & 0xff]
+            ^ crc32c_table[5][(v >> 16) & 0xff]
+            ^ crc32c_table[4][(v >> 24) & 0xff]
+            ^ crc32c_table[3][(v >> 32) & 0xff]
+            ^ crc32c_table[2][(v >> 40) & 0xff]
+            ^ crc32c_table[1][(v >> 48) & 0xff]
+            ^ crc32c_table[0][v >> 56];
+    }
+
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+
+    return crc;
+}
+
+#ifdef HAVE_CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t crc64 = crc, v;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+
+    for (crc = crc64; len--; )
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+#elif defined(HAVE_CRC32C_ARM)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t v;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+#if defined(HAVE_CRC32C_X86)
+    if (__builtin_cpu_supports("sse4.2")) {
+        __atomic_store_n(&crc32c_impl, crc32c_hw, __ATOMIC_RELEASE);
+        return;
+    }
+#elif defined(HAVE_CRC32C_ARM)
+    __atomic_store_n(&crc32c_impl, crc32c_hw, __ATOMIC_RELEASE);
+    return;
+#endif
+
+    crc32c_init_table();
+    __atomic_store_n(&crc32c_impl, crc32c_sw, __ATOMIC_RELEASE);
+}
+
+static uint32_t crc32c_resolve(uint32_t crc, const unsigned char *p, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return __atomic_load_n(&crc32c_impl, __ATOMIC_ACQUIRE)(crc, p, len);
+}
+
+uint32_t exio_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    return ~__atomic_load_n(&crc32c_impl, __ATOMIC_ACQUIRE)(~crc, data, len);
+}
+
+bool exio_hash_fd(int fd, uint32_t *crc)
+{
+    unsigned char buf[COPY_BUF / 2];
+
+    off_t   size = fsize(fd), off = 0;
+    ssize_t n;
+    void   *map;
+
+    *crc = 0;
+
+    /* Mapping is only worth it for larger files */
+    if (size >= HASH_MMAP_MIN) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+            *crc = exio_crc32c(0, map, size);
+            munmap(map, size);
+            return true;
+        }
+    }
+
+    /* Read from the start, like the mapping, for files without a size too */
+    while ((n = (size > 0) ? pread(fd, buf, sizeof(buf), off)
+                           : read(fd, buf, sizeof(buf))) != 0) {
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return false;
+
+        *crc = exio_crc32c(*crc, buf, n);
+        off += n;
+    }
+
+    return true;
+}
+
+bool exio_hash_file(const char *path, uint32_t *crc)
+{
+    int  fd, error;
+    bool ret;
+
+    if ((fd = path_open(path, O_RDONLY | O_CLOEXEC, 0)) == -1) return false;
+
+    ret = exio_hash_fd(fd, crc);
+    error = errno;
+    close(fd);
+    errno = error;
+
+    return ret;
+}
+
+struct hash_job {
+    const char *path;
+    uint32_t   *crc;
+};
+
+static void hash_job(struct pool *pool, void *arg)
+{
+    struct hash_job *job = arg;
+
+    if (!exio_hash_file(job->path, job->crc)) {
+        *job->crc = 0;
+        pool_fail(pool, errno);
+    }
+}
+
+bool exio_hash_files(const char *const *paths, size_t n, uint32_t *crcs,
+                     unsigned nthreads)
+{
+    struct hash_job *jobs;
+    struct pool     *pool;
+    size_t i;
+    int    error;
+
+    if (n == 0) return true;
+
+    if (n > SIZE_MAX / sizeof(*jobs)) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    /* Files which are never read, as past a failed submission, are left at 0 */
+    memset(crcs, 0, n * sizeof(*crcs));
+
+    if (!(jobs = mem_alloc(n * sizeof(*jobs)))) return false;
+
+    if (!(pool = pool_new(nthreads))) {
+        mem_free(jobs);
+        return false;
+    }
+
+    for (i = 0; i < n; ++i) {
+        jobs[i].path = paths[i], jobs[i].crc = &crcs[i];
+        if (!pool_submit(pool, hash_job, &jobs[i])) break;
+    }
+
+    error = pool_run(pool);
+    mem_free(jobs);
+
+    errno = error;
+    return !error;
+}
+
+/* Iterator over the entries of a directory. The 'getdents64()' system call is
+   used directly where available, which avoids the 'DIR' machinery. */
+struct dir_iter {
+    int            fd;
+#ifdef SYS_getdents64
+    size_t         pos, len;
+    char           buf[DIRENT_BUF];
+#else
+    DIR           *dir;
+#endif
+};
+
+#ifdef SYS_getdents64
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+#endif
+
+static bool dir_open(struct dir_iter *it, int dirfd, const char *path)
+{
+    it->fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (it->fd == -1) return false;
+
+#ifdef SYS_getdents64
+    it->pos = it->len = 0;
+#else
+    if (!(it->dir = fdopendir(it->fd))) {
+        close(it->fd);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/* Get the next entry other than "." and "..". Returns false at the end, or on
+   failure with errno set. */
+static bool dir_next(struct dir_iter *it, const char **name, unsigned char *type)
+{
+#ifdef SYS_getdents64
+    struct linux_dirent64 *ent;
+    long n;
+
+    for (;;) {
+        if (it->pos == it->len) {
+            n = syscall(SYS_getdents64, it->fd, it->buf, sizeof(it->buf));
+            if (n <= 0) {
+                if (n == 0) errno = 0;
+                return false;
+            }
+
+            it->pos = 0, it->len = n;
+        }
+
+        ent = (struct linux_dirent64 *) (it->buf + it->pos);
+        it->pos += ent->d_reclen;
+
+        if (!STR_EQ(ent->d_name, ".") && !STR_EQ(ent->d_name, "..")) {
+            *name = ent->d_name, *type = ent->d_type;
+            return true;
+        }
+    }
+#else
+    struct dirent *ent;
+
+    while ((errno = 0, ent = readdir(it->dir))) {
+        if (!STR_EQ(ent->d_name, ".") && !STR_EQ(ent->d_name, "..")) {
+            *name = ent->d_name, *type = ent->d_type;
+            return true;
+        }
+    }
+
+    return false;
+#endif
+}
+
+/* Start reading the entries of the directory again, as they are now. */
+static bool dir_rewind(struct dir_iter *it)
+{
+#ifdef SYS_getdents64
+    it->pos = it->len = 0;
+    return lseek(it->fd, 0, SEEK_SET) == 0;
+#else
+    rewinddir(it->dir);
+    return true;
+#endif
+}
+
+static void dir_close(struct dir_iter *it)
+{
+#ifdef SYS_getdents64
+    close(it->fd);
+#else
+    closedir(it->dir);
+#endif
+}
+
+enum glob_seg_kind {
+    SEG_LITERAL,
+    SEG_PATTERN,
+    SEG_ANY_DIRS                        // "**"
+};
+
+struct glob_seg {
+    enum glob_seg_kind  kind;
+    char               *text;
+};
+
+/* A pattern compiled into its path segments. Matching tracks the set of
+   segments that the next path component may match as a bitmask, in which bit
+   'nsegs' means that the path matched entirely. */
+struct exio_glob {
+    size_t          nsegs;
+    uint64_t        start;
+    struct glob_seg segs[];
+};
+
+/* Add to 'state' the segments following "**" segments in it, which may match
+   no directories at all. */
+static uint64_t glob_closure(const struct exio_glob *g, uint64_t state)
+{
+    size_t i;
+
+    for (i = 0; i < g->nsegs; ++i) {
+        if ((state >> i & 1) && g->segs[i].kind == SEG_ANY_DIRS)
+            state |= (uint64_t) 1 << (i + 1);
+    }
+
+    return state;
+}
+
+/* Advance 'state' past the path component 'name'. */
+static uint64_t glob_step(const struct exio_glob *g, uint64_t state,
+                          const char *name)
+{
+    const struct glob_seg *seg;
+
+    uint64_t next = 0;
+    size_t   i;
+
+    for (i = 0; i < g->nsegs; ++i) {
+        if (!(state >> i & 1)) continue;
+        seg = &g->segs[i];
+
+        switch (seg->kind) {
+        case SEG_LITERAL:
+            if (STR_EQ(seg->text, name)) next |= (uint64_t) 1 << (i + 1);
+            break;
+
+        case SEG_PATTERN:
+            if (fnmatch(seg->text, name, FNM_PERIOD) == 0)
+                next |= (uint64_t) 1 << (i + 1);
+            break;
+
+        case SEG_ANY_DIRS:
+            /* Hidden entries must be matched explicitly, as with '*' */
+            if (*name != '.') next |= (uint64_t) 1 << i;
+            break;
+        }
+    }
+
+    return glob_closure(g, next);
+}
+
+struct exio_glob *exio_glob_compile(const char *pattern)
+{
+    struct exio_glob *g;
+
+    const char *seg, *end;
+    char       *text;
+    size_t      nsegs = 0, len;
+
+    for (seg = pattern; *seg; seg = end) {
+        while (*seg == '/') ++seg;
+        if (!*seg) break;
+
+        end = strchrnul(seg, '/');
+        ++nsegs;
+    }
+
+    if (nsegs > GLOB_SEGS_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!(g = mem_calloc(1, sizeof(*g) + nsegs * sizeof(*g->segs)))) return NULL;
+
+    for (seg = pattern; *seg; seg = end) {
+        while (*seg == '/') ++seg;
+        if (!*seg) break;
+
+        end = strchrnul(seg, '/');
+        len = end - seg;
+
+        if (!(text = mem_alloc(len + 1))) {
+            exio_glob_free(g);
+            return NULL;
+        }
+
+        memcpy(text, seg, len);
+        text[len] = '\0';
+
+        g->segs[g->nsegs].text = text;
+        g->segs[g->nsegs++].kind = STR_EQ(text, "**") ? SEG_ANY_DIRS
+                                 : strpbrk(text, "*?[\\") ? SEG_PATTERN
+                                 : SEG_LITERAL;
+    }
+
+    g->start = glob_closure(g, 1);
+    return g;
+}
+
+void exio_glob_free(struct exio_glob *g)
+{
+    size_t i;
+
+    if (!g) return;
+
+    for (i = 0; i < g->nsegs; ++i)
+        mem_free(g->segs[i].text);
+
+    mem_free(g);
+}
+
+bool exio_glob_match(const struct exio_glob *g, const char *path)
+{
+    char        name[NAME_MAX + 1];
+    const char *end;
+    uint64_t    state = g->start;
+
+    for (; *path && state; path = end) {
+        while (*path == '/') ++path;
+        if (!*path) break;
+
+        end = strchrnul(path, '/');
+        if ((size_t) (end - path) > NAME_MAX) return false;
+
+        memcpy(name, path, end - path);
+        name[end - path] = '\0';
+        state = glob_step(g, state, name);
+    }
+
+    return state >> g->nsegs & 1;
+}
+
+struct glob_walk {
+    const struct exio_glob *g;
+    int                     root;
+    bool                  (*func)(const char *path, void *arg);
+    void                   *arg;
+    int                     error;      // First unreadable directory
+};
+
+/* Record 'error' from reading a directory. Unlike a failure of the pool, this
+   does not stop the rest of the walk. */
+static void glob_error(struct glob_walk *walk, int error)
+{
+    int none = 0;
+
+    __atomic_compare_exchange_n(&walk->error, &none, error, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void glob_dir(struct pool *pool, void *arg)
+{
+    struct tree_node *node = arg, *child;
+    struct glob_walk *walk = node->tree;
+    struct dir_iter   it;
+    struct stat       st;
+
+    const char   *name;
+    unsigned char type;
+    uint64_t      state, more;
+
+    if (!dir_open(&it, walk->root, node->path)) {
+        glob_error(walk, errno);
+        mem_free(node);
+        return;
+    }
+
+    /* Any state other than the final one means deeper paths can match */
+    more = ((uint64_t) 1 << walk->g->nsegs) - 1;
+
+    while (!pool_failed(pool)) {
+        if (!dir_next(&it, &name, &type)) {
+            if (errno) glob_error(walk, errno);
+            break;
+        }
+
+        if (!(state = glob_step(walk->g, node->state, name))) continue;
+
+        if (!(child = tree_node_new(walk, node->path, name))) {
+            pool_fail(pool, errno);
+            break;
+        }
+
+        if (state >> walk->g->nsegs & 1) {
+            if (!walk->func(child->path, walk->arg)) {
+                pool_fail(pool, ECANCELED);
+                mem_free(child);
+                break;
+            }
+        }
+
+        /* Only stat when the file system does not provide the type */
+        if ((state & more) && type == DT_UNKNOWN) {
+            type = (fstatat(it.fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                    && S_ISDIR(st.st_mode)) ? DT_DIR : DT_REG;
+        }
+
+        if ((state & more) && type == DT_DIR) {
+            child->state = state;
+            if (pool_submit(pool, glob_dir, child)) continue;
+        }
+
+        mem_free(child);
+    }
+
+    dir_close(&it);
+    mem_free(node);
+}
+
+bool exio_glob(const struct exio_glob *g, const char *root,
+               bool (*func)(const char *path, void *arg), void *arg,
+               unsigned nthreads)
+{
+    struct glob_walk  walk = { g, -1, func, arg, 0 };
+    struct tree_node *node;
+    struct pool      *pool;
+    int               error;
+
+    if ((walk.root = path_open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0))
+        == -1)
+        return false;
+
+    if (!(pool = pool_new(nthreads))) goto fail;
+
+    if (!(node = tree_node_new(&walk, ".", "."))) {
+        error = errno;
+        pool_run(pool);
+        goto out;
+    }
+
+    node->state = g->start;
+
+    if (!pool_submit(pool, glob_dir, node)) mem_free(node);
+
+    /* Cancellation and lack of memory take precedence over unreadable
+       directories, as they stopped the walk */
+    if (!(error = pool_run(pool))) error = walk.error;
+
+    goto out;
+
+fail:
+    error = errno;
+
+out:
+    close(walk.root);
+
+    errno = error;
+    return !error;
+}
+
+/* A file followed by 'exio_follow_wait()', with the incomplete line at the end
+   of the data read so far kept in 'buf'. */
+struct follow_file {
+    char        *path;
+    const char  *name;                  // Last component of 'path'
+    int          fd;
+    int          wd, dir_wd;            // Watches on the file and its directory
+    dev_t        dev;
+    ino_t        ino;
+    off_t        off;
+    char        *buf;
+    size_t       len, cap;
+    bool       (*func)(const char *line, size_t len, void *arg);
+    void        *arg;
+};
+
+struct exio_follow {
+    int                 ifd;            // -1 without inotify
+    struct follow_file *files;
+    size_t              nfiles;
+    uint64_t            checked;        // Time every file was last checked
+};
+
+struct exio_follow *exio_follow_new(void)
+{
+    struct exio_follow *f;
+
+    if (!(f = mem_calloc(1, sizeof(*f)))) return NULL;
+
+#ifdef IN_CLOEXEC
+    /* Without inotify, files are polled instead */
+    f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    f->ifd = -1;
+#endif
+
+    return f;
+}
+
+void exio_follow_free(struct exio_follow *f)
+{
+    size_t i;
+
+    if (!f) return;
+
+    for (i = 0; i < f->nfiles; ++i) {
+        if (f->files[i].fd != -1) close(f->files[i].fd);
+        mem_free(f->files[i].path);
+        mem_free(f->files[i].buf);
+    }
+
+    if (f->ifd != -1) close(f->ifd);
+    mem_free(f->files);
+    mem_free(f);
+}
+
+/* (Re)open 'ff', starting at its end if 'at_end'. A missing file is not an
+   error, as it may yet be created. */
+static bool follow_open(struct exio_follow *f, struct follow_file *ff,
+                        bool at_end)
+{
+    struct stat st;
+    int         error;
+
+    if ((ff->fd = path_open(ff->path, O_RDONLY | O_CLOEXEC | O_NOCTTY, 0)) == -1)
+        return errno == ENOENT;
+
+    if (fstat(ff->fd, &st) != 0) {
+        error = errno;
+        close(ff->fd);
+        ff->fd = -1;
+        errno = error;
+        return false;
+    }
+
+    ff->dev = st.st_dev, ff->ino = st.st_ino;
+    ff->off = at_end ? st.st_size : 0;
+
+#ifdef IN_CLOEXEC
+    if (f->ifd != -1)
+        ff->wd = inotify_add_watch(f->ifd, ff->path, IN_MODIFY);
+#else
+    (void) f;
+#endif
+
+    return true;
+}
+
+#ifdef IN_CLOEXEC
+/* Remove the watch 'wd' of 'ff', unless another file of 'f' shares it, as
+   watches on the same inode (such as a common directory) are one. */
+static void follow_unwatch(struct exio_follow *f, const struct follow_file *ff,
+                           int wd)
+{
+    size_t i;
+
+    for (i = 0; i < f->nfiles; ++i) {
+        if (&f->files[i] != ff
+            && (f->files[i].wd == wd || f->files[i].dir_wd == wd))
+            return;
+    }
+
+    inotify_rm_watch(f->ifd, wd);
+}
+#endif
+
+/* Deliver the complete lines in the buffer of 'ff', or everything if 'all'. */
+static bool follow_lines(struct follow_file *ff, bool all)
+{
+    char *line = ff->buf, *end = ff->buf + ff->len, *nl;
+
+    for (; (nl = memchr(line, '\n', end - line)); line = nl + 1) {
+        if (!ff->func(line, nl - line, ff->arg)) goto cancel;
+    }
+
+    if (all && line < end) {
+        if (!ff->func(line, end - line, ff->arg)) goto cancel;
+        line = end;
+    }
+
+    ff->len = end - line;
+    memmove(ff->buf, line, ff->len);
+    return true;
+
+cancel:
+    errno = ECANCELED;
+    return false;
+}
+
+/* Read and deliver the data appended to 'ff'. */
+static bool follow_read(struct follow_file *ff)
+{
+    ssize_t n;
+    char   *buf;
+
+    if (ff->fd == -1) return true;
+
+    /* The file was truncated, so start over */
+    if (fsize(ff->fd) < ff->off) ff->off = 0;
+
+    for (;;) {
+        if (ff->cap - ff->len < FOLLOW_BUF / 2) {
+            if (!(buf = mem_realloc(ff->buf, ff->cap + FOLLOW_BUF))) return false;
+            ff->buf = buf, ff->cap += FOLLOW_BUF;
+        }
+
+        n = pread(ff->fd, ff->buf + ff->len, ff->cap - ff->len, ff->off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return n == 0;
+
+        ff->len += n, ff->off += n;
+        if (!follow_lines(ff, false)) return false;
+
+        /* A line without an end in sight is delivered in parts, rather than
+           buffered without bound */
+        if (ff->len >= FOLLOW_LINE_MAX && !follow_lines(ff, true)) return false;
+    }
+}
+
+/* Reopen 'ff' if its path now refers to a different file, after delivering the
+   rest of the old one. */
+static bool follow_check(struct exio_follow *f, struct follow_file *ff)
+{
+    struct stat st;
+
+    if (stat(ff->path, &st) != 0) return errno == ENOENT;
+    if (ff->fd != -1 && st.st_dev == ff->dev && st.st_ino == ff->ino)
+        return true;
+
+    if (ff->fd != -1) {
+        if (!follow_read(ff) || !follow_lines(ff, true)) return false;
+
+#ifdef IN_CLOEXEC
+        if (f->ifd != -1 && ff->wd != -1) follow_unwatch(f, ff, ff->wd);
+#endif
+        close(ff->fd);
+        ff->fd = ff->wd = -1;
+    }
+
+    return follow_open(f, ff, false) && follow_read(ff);
+}
+
+bool exio_follow_add(struct exio_follow *f, const char *path, bool from_end,
+                     bool (*func)(const char *line, size_t len, void *arg),
+                     void *arg)
+{
+    struct follow_file *files, *ff;
+    char *slash;
+    int   error;
+
+    if (!(files = mem_realloc(f->files, (f->nfiles + 1) * sizeof(*files))))
+        return false;
+
+    f->files = files;
+    ff = &files[f->nfiles];
+    memset(ff, 0, sizeof(*ff));
+    ff->fd = ff->wd = ff->dir_wd = -1;
+    ff->func = func, ff->arg = arg;
+
+    if (!(ff->path = mem_strdup(path))) return false;
+
+    slash = strrchr(ff->path, '/');
+    ff->name = slash ? slash + 1 : ff->path;
+
+#ifdef IN_CLOEXEC
+    /* Rotation shows up as files being created or moved in the directory */
+    if (f->ifd != -1) {
+        if (slash) *slash = '\0';
+        ff->dir_wd = inotify_add_watch(f->ifd, slash ? (*ff->path ? ff->path
+                                       : "/") : ".", IN_CREATE | IN_MOVED_TO);
+        if (slash) *slash = '/';
+    }
+#endif
+
+    if (!follow_open(f, ff, from_end)) goto fail;
+
+    ++f->nfiles;
+    return true;
+
+fail:
+    error = errno;
+
+#ifdef IN_CLOEXEC
+    if (ff->wd != -1) follow_unwatch(f, ff, ff->wd);
+    if (ff->dir_wd != -1) follow_unwatch(f, ff, ff->dir_wd);
+#endif
+    if (ff->fd != -1) close(ff->fd);
+    mem_free(ff->path);
+
+    errno = error;
+    return false;
+}
+
+bool exio_follow_wait(struct exio_follow *f, int timeout_ms)
+{
+    struct pollfd pfd = { f->ifd, POLLIN, 0 };
+
+#ifdef IN_CLOEXEC
+    struct inotify_event *ev;
+    struct follow_file   *ff;
+
+    char    events[4096] __attribute__((aligned(8)));
+    ssize_t n, i;
+#endif
+    uint64_t elapsed, wait;
+    size_t   j;
+    bool     poll_all;
+    int      ret;
+
+    /* Events only cover files whose directory exists, so every file is also
+       checked on a timer, which a steady stream of events must not defer */
+    elapsed = (clock_ns() - f->checked) / 1000000;
+    wait = elapsed < FOLLOW_POLL_MS ? FOLLOW_POLL_MS - elapsed : 0;
+    if (timeout_ms >= 0 && (uint64_t) timeout_ms < wait) wait = timeout_ms;
+
+    ret = poll(f->ifd != -1 ? &pfd : NULL, f->ifd != -1, (int) wait);
+    if (ret == -1) return errno == EINTR;
+
+    /* Without events (or inotify), every file is checked */
+    poll_all = ret == 0
+            || clock_ns() - f->checked >= FOLLOW_POLL_MS * (uint64_t) 1000000;
+
+#ifdef IN_CLOEXEC
+    while (ret > 0 && (n = read(f->ifd, events, sizeof(events))) > 0) {
+        for (i = 0; i < n; i += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) (events + i);
+            if (ev->mask & IN_Q_OVERFLOW) poll_all = true;
+
+            for (j = 0; j < f->nfiles && !poll_all; ++j) {
+                ff = &f->files[j];
+
+                if (ev->wd == ff->wd && !follow_read(ff)) return false;
+
+                if (ev->wd == ff->dir_wd && ev->len && STR_EQ(ev->name, ff->name)
+                    && !follow_check(f, ff))
+                    return false;
+            }
+        }
+    }
+#endif
+
+    if (poll_all) {
+        f->checked = clock_ns();
+
+        for (j = 0; j < f->nfiles; ++j) {
+            if (!follow_read(&f->files[j]) || !follow_check(f, &f->files[j]))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool exio_follow(const char *path,
+                 bool (*func)(const char *line, size_t len, void *arg),
+                 void *arg)
+{
+    struct exio_follow *f;
+    bool ret;
+    int  error;
+
+    if (!(f = exio_follow_new())) return false;
+
+    ret = exio_follow_add(f, path, true, func, arg);
+    while (ret) ret = exio_follow_wait(f, FOLLOW_POLL_MS);
+
+    error = errno;
+    exio_follow_free(f);
+    errno = error;
+
+    return ret;
+}
+
+static bool is_pipe(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/* Whether data can be spliced into 'fd'; files open for appending cannot. */
+static bool can_splice(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && !(flags & O_APPEND);
+}
+
+/* Whether a write to 'fd' can wait indefinitely on a slow reader, as with
+   pipes, sockets and terminals. */
+static bool may_stall(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+}
+
+/* Move 'len' bytes from the pipe 'in' to 'out'. */
+static bool splice_all(int in, int out, size_t len)
+{
+    ssize_t n;
+
+    for (; len > 0; len -= n) {
+        if ((n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE)) <= 0) {
+            if (n == -1 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+
+            if (n == 0) errno = EPIPE;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Duplicate the pipe 'in' to the outputs without copying through user space.
+   Outputs other than the last are fed through private pipes, as 'tee()' only
+   works between pipes; these are drained every round, so with several outputs
+   none of them may be a pipe or anything else which can stall the others.
+   Returns 0 on success, -1 on failure, and 1 if the kernel cannot splice these
+   files (before anything was consumed). */
+static int tee_splice(int in, const int *outs, size_t n)
+{
+    char   *buf = NULL;
+    size_t *done, i;
+    ssize_t k, t, r;
+    int   (*pipes)[2];
+    int     ret = -1, error;
+    bool    started = false;
+
+    if (!(done = mem_calloc(n, sizeof(*done) + sizeof(*pipes)))) return -1;
+    pipes = (int (*)[2]) (done + n);
+
+    for (i = 0; i + 1 < n; ++i) {
+        pipes[i][0] = pipes[i][1] = -1;
+        if (pipe2(pipes[i], O_CLOEXEC) != 0) goto out;
+
+#ifdef F_SETPIPE_SZ
+        /* A larger pipe means fewer rounds, but the default is fine too */
+        fcntl(pipes[i][1], F_SETPIPE_SZ, TEE_CHUNK);
+#endif
+    }
+
+    for (;;) {
+        /* The first output determines how much is taken in this round */
+        k = (n > 1) ? tee(in, pipes[0][1], TEE_CHUNK, 0)
+                    : splice(in, NULL, outs[0], NULL, TEE_CHUNK, SPLICE_F_MOVE);
+
+        if (k == -1 && errno == EINTR) continue;
+        if (k <= 0) {
+            ret = (k == -1 && !started && errno == EINVAL) ? 1 : k;
+            goto out;
+        }
+
+        started = true;
+        if (n == 1) continue;
+
+        done[0] = k;
+        for (i = 1; i + 1 < n; ++i) {
+            do {
+                t = tee(in, pipes[i][1], k, 0);
+            } while (t == -1 && errno == EINTR);
+
+            if (t == -1) goto out;
+            done[i] = t;
+        }
+
+        for (i = 0; i + 1 < n; ++i) {
+            if (!splice_all(pipes[i][0], outs[i], done[i])) goto out;
+        }
+
+        for (i = 0; i + 1 < n && done[i] == (size_t) k; ++i);
+
+        /* Normally the data is moved to the last output. Outputs which could
+           not take all of it (when their pipe filled up) get the rest from a
+           copy instead. */
+        if (i + 1 == n) {
+            if (!splice_all(in, outs[n - 1], k)) goto out;
+            continue;
+        }
+
+        if (!buf && !(buf = mem_alloc(TEE_CHUNK))) goto out;
+
+        for (t = 0; t < k; ) {
+            r = read(in, buf + t, k - t);
+
+            if (r == -1 && errno == EINTR) continue;
+            if (r <= 0) goto out;
+            t += r;
+        }
+
+        for (i = 0; i < n; ++i) {
+            t = (i + 1 < n) ? (ssize_t) done[i] : 0;
+            if (t < k && !write_all(outs[i], buf + t, k - t)) goto out;
+        }
+    }
+
+out:
+    error = errno;
+
+    for (i = 0; i + 1 < n; ++i) {
+        if (pipes[i][0] != -1) close(pipes[i][0]);
+        if (pipes[i][1] != -1) close(pipes[i][1]);
+    }
+
+    mem_free(done);
+    mem_free(buf);
+
+    errno = error;
+    return ret;
+}
+
+/* Duplicate 'in' to the outputs through a bounded ring buffer. Each output
+   proceeds at its own pace, and input is only read while the slowest output is
+   less than the size of the buffer behind. */
+static bool tee_copy(int in, const int *outs, size_t n)
+{
+    struct pollfd *pfds;
+    struct iovec   iov[2];
+
+    uint64_t *pos, head = 0, tail;
+    size_t    i, off, len, cnt;
+    ssize_t   k;
+    char     *buf;
+    bool      eof = false, ret = false, *pipe_out;
+    int       used, cap;
+
+    buf = mem_alloc(TEE_BUF);
+    pos = mem_calloc(n, sizeof(*pos));
+    pfds = mem_calloc(n + 1, sizeof(*pfds));
+    pipe_out = mem_calloc(n, sizeof(*pipe_out));
+    if (!buf || !pos || !pfds || !pipe_out) goto out;
+
+    for (i = 0; i < n; ++i)
+        pipe_out[i] = is_pipe(outs[i]);
+
+    for (;;) {
+        for (tail = head, i = 0; i < n; ++i) {
+            if (pos[i] < tail) tail = pos[i];
+        }
+
+        if (eof && tail == head) break;
+
+        pfds[n].fd = (!eof && head - tail < TEE_BUF) ? in : -1;
+        pfds[n].events = POLLIN;
+
+        for (i = 0; i < n; ++i) {
+            pfds[i].fd = (pos[i] < head) ? outs[i] : -1;
+            pfds[i].events = POLLOUT;
+        }
+
+        if (poll(pfds, n + 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            goto out;
+        }
+
+        for (i = 0; i < n; ++i) {
+            if (!pfds[i].revents) continue;
+
+            off = pos[i] % TEE_BUF;
+            len = head - pos[i];
+
+            /* A blocking pipe only accepts a write without blocking if there is
+               room for all of it */
+#ifdef F_GETPIPE_SZ
+            if (pipe_out[i] && (cap = fcntl(outs[i], F_GETPIPE_SZ)) > 0
+                && ioctl(outs[i], FIONREAD, &used) == 0 && (size_t) (cap - used) < len)
+                len = (cap > used) ? cap - used : 1;
+#endif
+
+            iov[0].iov_base = buf + off;
+            iov[0].iov_len = (len < TEE_BUF - off) ? len : TEE_BUF - off;
+            iov[1].iov_base = buf;
+            iov[1].iov_len = len - iov[0].iov_len;
+            cnt = iov[1].iov_len ? 2 : 1;
+
+            if ((k = writev(outs[i], iov, cnt)) == -1) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                goto out;
+            }
+
+            pos[i] += k;
+        }
+
+        if (pfds[n].fd != -1 && pfds[n].revents) {
+            off = head % TEE_BUF;
+            len = TEE_BUF - (head - tail);
+            if (len > TEE_BUF - off) len = TEE_BUF - off;
+
+            if ((k = read(in, buf + off, len)) == -1) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                goto out;
+            }
+
+            if (k == 0) eof = true;
+            head += k;
+        }
+    }
+
+    ret = true;
+
+out:
+    mem_free(buf);
+    mem_free(pos);
+    mem_free(pfds);
+    mem_free(pipe_out);
+
+    return ret;
+}
+
+bool exio_tee(int in_fd, const int *out_fds, size_t n)
+{
+    size_t i;
+    int    ret;
+
+    if (n == 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    /* Splicing requires the input to be a pipe, and is not supported for every
+       kind of output. With several outputs it moves them in lockstep, so it is
+       only used when none of them can be held up by a slow reader. */
+    for (i = 0; i < n; ++i) {
+        if (!is_pipe(out_fds[i]) && !can_splice(out_fds[i])) break;
+        if (n > 1 && may_stall(out_fds[i])) break;
+    }
+
+    if (i == n && is_pipe(in_fd) && (ret = tee_splice(in_fd, out_fds, n)) != 1)
+        return ret == 0;
 
-#define CHAR_YES    'y'
-#define CHAR_NO     'n'
+    return tee_copy(in_fd, out_fds, n);
+}
 
-#define STR_EQ(a, b) (strcmp(a, b) == 0)
-#define ARRAY_LEN(a) (sizeof(a) / sizeof(*(a)))
+/* The resource reporter, with the files it reads kept open. */
+static struct {
+    pthread_t         thread;
+    bool              running, stop;
+    uint64_t          interval;         // In nanoseconds
+    int               stat_fd, io_fd;
+    bool              have_fds;
+    struct dir_iter   fds;              // Of '/proc/self/fd'
+    void            (*func)(const struct exio_usage *total,
+                            const struct exio_usage *delta, void *arg);
+    void             *arg;
+} usage;
 
-#define MSG(pref, format)                                   \
-    do {                                                    \
-        va_list ap;                                         \
-        bool ret;                                           \
-                                                            \
-        va_start(ap, (format));                             \
-                                                            \
-        ret = (fputs((pref), stderr) != EOF                 \
-               && vfprintf(stderr, (format), ap) >= 0       \
-               && fputc('\n', stderr) != EOF);              \
-                                                            \
-        va_end(ap);                                         \
-        return ret;                                         \
-    } while (0)
+static pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  usage_cond = PTHREAD_COND_INITIALIZER;
+
+/* Read the file 'fd' from its start into 'buf' as a string. */
+static bool usage_read(int fd, char *buf, size_t buf_sz)
+{
+    ssize_t n;
 
+    if (fd == -1) return false;
 
-bool err(const char *restrict format, ...)
+    while ((n = pread(fd, buf, buf_sz - 1, 0)) == -1 && errno == EINTR);
+    if (n <= 0) return false;
+
+    buf[n] = '\0';
+    return true;
+}
+
+/* Get the value of the line starting with 'key' in 'buf', or 0. */
+static uint64_t usage_field(const char *buf, const char *key)
 {
-    MSG(C_ERROR PREF_ERROR C_NORMAL, format);
+    const char *p = buf;
+    size_t      len = strlen(key);
+
+    for (; p; p = strchr(p, '\n')) {
+        if (*p == '\n') ++p;
+        if (strncmp(p, key, len) == 0) return strtoull(p + len, NULL, 10);
+    }
+
+    return 0;
 }
 
-bool warn(const char *restrict format, ...)
+static void usage_sample(struct exio_usage *u)
+{
+    struct rusage ru;
+
+    char          buf[USAGE_BUF];
+    const char   *p;
+    const char   *name;
+    unsigned char type;
+    size_t        i;
+
+    memset(u, 0, sizeof(*u));
+    u->time_ns = clock_ns();
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        u->user_us = (uint64_t) ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+        u->sys_us = (uint64_t) ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+        u->vol_switches = ru.ru_nvcsw;
+        u->invol_switches = ru.ru_nivcsw;
+    }
+
+    /* The fields follow the command name, which may contain anything; the
+       thread count and resident pages are fields 20 and 24 */
+    if (usage_read(usage.stat_fd, buf, sizeof(buf)) && (p = strrchr(buf, ')'))) {
+        for (i = 3; p && i <= 24; ++i) {
+            p = strchr(p + 1, ' ');
+            if (p && i == 20) u->threads = strtoull(p + 1, NULL, 10);
+        }
+
+        if (p) u->rss = strtoull(p + 1, NULL, 10) * sysconf(_SC_PAGESIZE);
+    }
+
+    if (usage_read(usage.io_fd, buf, sizeof(buf))) {
+        u->read_bytes = usage_field(buf, "rchar: ");
+        u->write_bytes = usage_field(buf, "wchar: ");
+    }
+
+    /* The files of the reporter itself are not counted */
+    if (usage.have_fds && dir_rewind(&usage.fds)) {
+        while (dir_next(&usage.fds, &name, &type)) ++u->fds;
+        u->fds -= 1 + (usage.stat_fd != -1) + (usage.io_fd != -1);
+    }
+}
+
+/* Format 'n' bytes with an appropriate unit into 'buf'. */
+static const char *usage_fmt(char *buf, size_t buf_sz, double n)
 {
-    MSG(C_WARNING PREF_WARNING C_NORMAL, format);
+    static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    size_t i;
+
+    for (i = 0; n >= 1024 && i < ARRAY_LEN(units) - 1; ++i)
+        n /= 1024;
+
+    snprintf(buf, buf_sz, "%.*f%s", i ? 1 : 0, n, units[i]);
+    return buf;
 }
 
-bool info(const char *restrict format, ...)
+static void usage_info(const struct exio_usage *total,
+                       const struct exio_usage *delta, void *arg)
 {
-    MSG(C_INFO PREF_INFO C_NORMAL, format);
+    char   rss[16], rd[16], wr[16];
+    double secs = delta->time_ns / 1e9;
+
+    (void) arg;
+
+    info("usage: rss=%s cpu=%.1f%% (user=%.2fs sys=%.2fs) ctxsw=%.0f/s "
+         "(invol=%.0f/s) read=%s/s write=%s/s fds=%zu threads=%zu",
+         usage_fmt(rss, sizeof(rss), total->rss),
+         (delta->user_us + delta->sys_us) / 1e4 / secs,
+         total->user_us / 1e6, total->sys_us / 1e6,
+         (delta->vol_switches + delta->invol_switches) / secs,
+         delta->invol_switches / secs,
+         usage_fmt(rd, sizeof(rd), delta->read_bytes / secs),
+         usage_fmt(wr, sizeof(wr), delta->write_bytes / secs),
+         total->fds, total->threads);
 }
 
-bool confirm(const char *prompt)
+static void *usage_work(void *arg)
 {
-    char in[] = { '\0', '\0', '\0' };
-    int  c;
+    struct exio_usage prev, cur, delta;
+    uint64_t          deadline, now;
 
-    for (;;) {
-        fputs(prompt, stderr);
-        if (!fgets(in, sizeof(in), stdin)) return false;
+    (void) arg;
+    usage_sample(&prev);
 
-        if (in[1] != '\n' && in[0] != '\n') {
-            /* Consume the rest of the input */
-            while ((c = fgetc(stdin)) != '\n' && c != EOF);
-            continue;
-        }
+    pthread_mutex_lock(&usage_lock);
 
-        if (in[0] == CHAR_YES)
-            return true;
-        else if (in[0] == CHAR_NO)
-            return false;
-        else
-            continue;
+    for (deadline = prev.time_ns + usage.interval;; deadline += usage.interval) {
+        while (!usage.stop && (now = clock_ns()) < deadline)
+            cond_wait_ns(&usage_cond, &usage_lock, deadline - now);
+
+        if (usage.stop) break;
+        pthread_mutex_unlock(&usage_lock);
+
+        usage_sample(&cur);
+        delta.rss = cur.rss;
+        delta.fds = cur.fds, delta.threads = cur.threads;
+        delta.time_ns = cur.time_ns - prev.time_ns;
+        delta.user_us = cur.user_us - prev.user_us;
+        delta.sys_us = cur.sys_us - prev.sys_us;
+        delta.vol_switches = cur.vol_switches - prev.vol_switches;
+        delta.invol_switches = cur.invol_switches - prev.invol_switches;
+        delta.read_bytes = cur.read_bytes - prev.read_bytes;
+        delta.write_bytes = cur.write_bytes - prev.write_bytes;
+
+        usage.func(&cur, &delta, usage.arg);
+        prev = cur;
+
+        pthread_mutex_lock(&usage_lock);
+
+        /* Reports missed during a stall are skipped, rather than made in a
+           burst */
+        if (cur.time_ns >= deadline + usage.interval) deadline = cur.time_ns;
     }
+
+    pthread_mutex_unlock(&usage_lock);
+    return NULL;
 }
 
-char *getusrln(const char *prompt, size_t *input_len, enum input_mode mode)
+bool exio_usage_start(unsigned interval_ms,
+                      void (*func)(const struct exio_usage *total,
+                                   const struct exio_usage *delta, void *arg),
+                      void *arg)
 {
-    struct termios old, new;
+    int error = 0;
 
-    ssize_t  input_sz;
-    char    *buf = NULL;
-    size_t   buf_sz = 0;
+    pthread_mutex_lock(&usage_lock);
 
-    if (mode == IN_HIDE) {
-        /* Test if terminal supports 'termios' */
-        if (tcgetattr(STDIN_FILENO, &old) != 0)
-            return NULL;
+    if (usage.running || !interval_ms) {
+        error = usage.running ? EBUSY : EINVAL;
+        goto out;
+    }
 
-        new = old;
-        new.c_lflag &= ~ECHO;
+    /* Files which cannot be opened are left out of the reports */
+    usage.stat_fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+    usage.io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    usage.have_fds = dir_open(&usage.fds, AT_FDCWD, "/proc/self/fd");
 
-        /* Temporarily disable terminal text echoing to hide input */
-        if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &new) != 0)
-            return NULL;
+    usage.interval = (uint64_t) interval_ms * 1000000;
+    usage.func = func ? func : usage_info;
+    usage.arg = arg;
+    usage.stop = false;
+
+    if ((error = pthread_create(&usage.thread, NULL, usage_work, NULL))) {
+        if (usage.stat_fd != -1) close(usage.stat_fd);
+        if (usage.io_fd != -1) close(usage.io_fd);
+        if (usage.have_fds) dir_close(&usage.fds);
+        goto out;
     }
 
-    fputs(prompt, stderr);
-    input_sz = getline(&buf, &buf_sz, stdin);
-    if (mode == IN_HIDE || input_sz == -1) fputc('\n', stderr);    /* Print the newline entered */
-    if (input_sz == -1) goto fail;
+    usage.running = true;
 
-    if (mode == IN_HIDE && tcsetattr(STDIN_FILENO, TCSAFLUSH, &old) != 0)
-        goto fail;
+out:
+    pthread_mutex_unlock(&usage_lock);
 
-    // Ignore the trailing newline
-    if (input_len)
-        *input_len = input_sz - 1;
-    else
-        buf[input_sz - 1] = '\0';
+    if (error) errno = error;
+    return !error;
+}
 
-    return buf;
+void exio_usage_stop(void)
+{
+    pthread_mutex_lock(&usage_lock);
 
-fail:
-    /* We have no way of reliably zeroing the memory allocated by 'getline()' on
-       failure because we cannot know its size or if it is safe to clear. This
-       is the disadvantage of accepting sensitive input of arbitrary length. */
-    free(buf);
-    return NULL;
+    if (!usage.running) {
+        pthread_mutex_unlock(&usage_lock);
+        return;
+    }
+
+    usage.stop = true;
+    pthread_cond_signal(&usage_cond);
+    pthread_mutex_unlock(&usage_lock);
+
+    pthread_join(usage.thread, NULL);
+
+    if (usage.stat_fd != -1) close(usage.stat_fd);
+    if (usage.io_fd != -1) close(usage.io_fd);
+    if (usage.have_fds) dir_close(&usage.fds);
+
+    pthread_mutex_lock(&usage_lock);
+    usage.running = false;
+    pthread_mutex_unlock(&usage_lock);
 }
 
-int get_xdg_path(char *restrict path, const char *sub_dir,
-                 const char *xdg_dir, const char *fallback_dir)
+struct bulk_region {
+    void   *addr;
+    size_t  len;
+};
+
+static struct bulk_region bulk_regions[BULK_MAX];
+static size_t             bulk_count;
+static pthread_mutex_t    bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t core_mode = CORE_DEFAULT;
+static char                  core_filter_old[32];
+static struct rlimit         core_limit_old;
+static int                   core_dumpable_old = 1;
+
+static void (*volatile handler_segv)(int signo);
+static void (*volatile handler_term)(int signo);
+
+/* Restrict '*addr' and '*len' to the pages entirely contained within them, as
+   required by 'madvise()'. Returns false if no such page exists. */
+static bool page_align(void **addr, size_t *len)
 {
-    const char *xdg, *home;
+    uintptr_t page  = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) *addr + page - 1) & ~(page - 1);
+    uintptr_t end   = ((uintptr_t) *addr + *len) & ~(page - 1);
 
-    if ((xdg = getenv(xdg_dir))) {
-        // Take the '/' character to be added into account
-        if (strlen(xdg) + strlen(sub_dir) + 1 > PATH_MAX)
-            goto fail;
+    if (end <= start) return false;
 
-        snprintf(path, PATH_MAX, "%s/%s", xdg, sub_dir);
-    } else if ((home = getenv("HOME"))) {
-        // Take the '/' characters to be added into account
-        if (strlen(home) + strlen(fallback_dir) + strlen(sub_dir)+ 2 > PATH_MAX)
-            goto fail;
+    *addr = (void *) start;
+    *len = end - start;
+    return true;
+}
 
-        snprintf(path, PATH_MAX, "%s/%s/%s", home, fallback_dir, sub_dir);
-    } else {
-        return -2;
+static bool bulk_advise(struct bulk_region *r, bool dump)
+{
+#if defined(MADV_DONTDUMP) && defined(MADV_DODUMP)
+    return madvise(r->addr, r->len, dump ? MADV_DODUMP : MADV_DONTDUMP) == 0;
+#else
+    (void) r, (void) dump;
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+/* Write 'filter' to the coredump filter, saving the previous value in 'old'
+   (if not NULL) in a form that can be written back. */
+static bool write_core_filter(const char *filter, char *old, size_t old_sz)
+{
+    ssize_t len;
+    int     fd = open(COREDUMP_FILTER, O_RDWR | O_CLOEXEC);
+
+    if (fd == -1) return false;
+
+    /* The filter is read as hexadecimal, but written with the base prefix */
+    if (old) {
+        len = read(fd, old + 2, old_sz - 3);
+        memcpy(old, "0x", 2);
+        old[len > 0 ? len + 2 : 0] = '\0';
     }
 
-    return 0;
+    len = pwrite(fd, filter, strlen(filter), 0);
+    close(fd);
 
-fail:
-    errno = ENAMETOOLONG;
-    return -1;
+    return len != -1;
 }
 
-bool mkpath(char *path)
+/* Whether 'signo' is one of the signals which dump a core by default. */
+static bool core_signal(int signo)
 {
-    char *path_iter;
+    switch (signo) {
+    case SIGSEGV:
+    case SIGABRT:
+    case SIGFPE:
+    case SIGILL:
+#ifdef SIGBUS
+    case SIGBUS:
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
 
-    /* The directories are created with permissions 0777 - umask, yielding
-       standard permissions. Error 'EEXIST' is acceptable because the path or
-       part of it may already exist, which we are expected to ignore. */
-    for (path_iter = path + 1; *path_iter; ++path_iter) {
-        if (*path_iter != '/') break;
-        *path_iter = '\0';      /* Temporarily truncate */
+/* Async-signal-safe report of a fatal signal, used when no core is dumped. */
+static void report_crash(int signo)
+{
+    static const char pref[] = C_ERROR PREF_ERROR C_NORMAL "fatal signal ";
+    static const char suff[] = ", no core dumped\n";
 
-        if (mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO) != 0 && errno != EEXIST) {
-            *path_iter = '/';
-            return false;
-        }
+    bool core = core_signal(signo);
 
-        *path_iter = '/';
-    }
+    char  buf[sizeof(pref) + sizeof(suff) + 8];
+    char  num[8];
+    char *p = buf;
+    int   i = 0;
+
+    do {
+        num[i++] = '0' + signo % 10;
+    } while ((signo /= 10) && i < (int) sizeof(num));
+
+    memcpy(p, pref, sizeof(pref) - 1), p += sizeof(pref) - 1;
+    while (i > 0) *p++ = num[--i];
+    if (core)
+        memcpy(p, suff, sizeof(suff) - 1), p += sizeof(suff) - 1;
+    else
+        *p++ = '\n';
+
+    /* Best effort; there is nothing to be done about failure here */
+    if (write(STDERR_FILENO, buf, p - buf) == -1) return;
+}
+
+static void crash_segv(int signo)
+{
+    msgbuf_flush_signal();
+    if (core_mode == CORE_NONE) report_crash(signo);
+    handler_segv(signo);
+}
+
+static void crash_term(int signo)
+{
+    msgbuf_flush_signal();
+    if (core_mode == CORE_NONE) report_crash(signo);
+    handler_term(signo);
+}
 
-    if (mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO) != 0 && errno != EEXIST)
+/* Wrap 'func' in 'wrapper' so the core mode is honoured, unless 'func' is one
+   of the special dispositions. */
+static void (*crash_wrap(void (*func)(int), void (*volatile *slot)(int),
+                         void (*wrapper)(int)))(int)
+{
+    if (func == SIG_DFL || func == SIG_IGN) return func;
+
+    *slot = func;
+    return wrapper;
+}
+
+bool exio_bulk_add(void *addr, size_t len)
+{
+    struct bulk_region r = { addr, len };
+    bool ret = false;
+
+    if (!page_align(&r.addr, &r.len)) {
+        errno = EINVAL;
         return false;
+    }
 
-    return true;
+    pthread_mutex_lock(&bulk_lock);
+
+    if (bulk_count == BULK_MAX)
+        errno = ENOMEM;
+    else if (bulk_advise(&r, false))
+        bulk_regions[bulk_count++] = r, ret = true;
+
+    pthread_mutex_unlock(&bulk_lock);
+    return ret;
 }
 
-off_t fsize(int fd)
+bool exio_bulk_remove(void *addr)
 {
-    struct stat st;
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    size_t    i;
 
-    /* We do not use 'fseek()' or 'ftello()' because 'SEEK_END' with binary data
-       is not standard C. */
-    return (fstat(fd, &st) == 0) ? st.st_size : -1;
+    pthread_mutex_lock(&bulk_lock);
+
+    for (i = 0; i < bulk_count; ++i) {
+        /* The start may have been rounded up to a page boundary */
+        if ((uintptr_t) bulk_regions[i].addr - (uintptr_t) addr >= page)
+            continue;
+
+        /* The region may already have been unmapped, which is fine */
+        bulk_advise(&bulk_regions[i], true);
+        bulk_regions[i] = bulk_regions[--bulk_count];
+        pthread_mutex_unlock(&bulk_lock);
+        return true;
+    }
+
+    pthread_mutex_unlock(&bulk_lock);
+    errno = ENOENT;
+    return false;
+}
+
+bool set_core_mode(enum core_mode mode)
+{
+    struct rlimit none;
+    bool ret = true;
+
+    pthread_mutex_lock(&bulk_lock);
+
+    /* The core size limit is only zero without a core */
+    if ((mode == CORE_NONE) != (core_mode == CORE_NONE)) {
+        if (mode == CORE_NONE) {
+            getrlimit(RLIMIT_CORE, &core_limit_old);
+            none = core_limit_old;
+            none.rlim_cur = 0;
+            ret = setrlimit(RLIMIT_CORE, &none) == 0;
+
+#ifdef PR_SET_DUMPABLE
+            /* A core pattern piping to a program ignores the limit */
+            if (ret) {
+                core_dumpable_old = prctl(PR_GET_DUMPABLE, 0, 0, 0, 0);
+                ret = prctl(PR_SET_DUMPABLE, 0, 0, 0, 0) == 0;
+            }
+#endif
+        } else {
+            ret = setrlimit(RLIMIT_CORE, &core_limit_old) == 0;
+
+#ifdef PR_SET_DUMPABLE
+            if (ret && core_dumpable_old > 0)
+                ret = prctl(PR_SET_DUMPABLE, core_dumpable_old, 0, 0, 0) == 0;
+#endif
+        }
+    }
+
+    /* Not every kernel has the filter, and excluding the bulk regions is what
+       matters most, so failure to change it is ignored. */
+    if (ret && (mode == CORE_SMALL) != (core_mode == CORE_SMALL)) {
+        if (mode == CORE_SMALL)
+            write_core_filter(COREDUMP_SMALL, core_filter_old,
+                              sizeof(core_filter_old));
+        else if (*core_filter_old)
+            write_core_filter(core_filter_old, NULL, 0);
+    }
+
+    if (ret) core_mode = mode;
+
+    pthread_mutex_unlock(&bulk_lock);
+    return ret;
 }
 
 void set_handler_segv(void (*func)(int signo))
@@ -199,7 +5882,7 @@ void set_handler_segv(void (*func)(int signo))
 
     memset(&act, 0, sizeof(act));
     sigfillset(&act.sa_mask);
-    act.sa_handler = func;
+    act.sa_handler = crash_wrap(func, &handler_segv, crash_segv);
 
     sigaction(SIGSEGV, &act, NULL);
 }
@@ -259,7 +5942,7 @@ void set_handler_term(void (*func)(int signo))
 
     memset(&act, 0, sizeof(act));
     memset(&test, 0, sizeof(test));
-    act.sa_handler = func;
+    act.sa_handler = crash_wrap(func, &handler_term, crash_term);
     act.sa_flags = SA_RESTART;
 
     for (i = 0; i < ARRAY_LEN(term_sigs); ++i) {
@@ -284,3 +5967,204 @@ void reset_handler(int signo)
 
     sigaction(signo, &act, NULL);
 }
+
+#ifdef EXIO_USE_TIMING
+
+/* Accumulated durations of a single timed scope name, in nanoseconds. Bucket
+   'i' of the histogram counts durations of less than 2^(i + 1) ns. */
+struct time_stat {
+    const char *name;
+    uint64_t    count, sum, min, max;
+    uint64_t    hist[TIME_BUCKETS];
+};
+
+struct time_table {
+    uint64_t         last_report;
+    struct time_stat stats[TIME_SLOTS];
+};
+
+static __thread struct time_table *time_table;
+static pthread_key_t               time_key;
+static pthread_once_t              time_once = PTHREAD_ONCE_INIT;
+static volatile uint64_t           time_interval;
+static FILE *volatile              time_output;
+
+static void time_table_free(void *table)
+{
+    time_table = table;
+    exio_time_report();
+    time_table = NULL;
+    mem_free(table);
+}
+
+static void time_key_create(void)
+{
+    pthread_key_create(&time_key, time_table_free);
+}
+
+static struct time_table *time_table_get(void)
+{
+    if (time_table) return time_table;
+
+    pthread_once(&time_once, time_key_create);
+
+    if (!(time_table = mem_calloc(1, sizeof(*time_table)))) return NULL;
+    time_table->last_report = exio_time_now();
+    pthread_setspecific(time_key, time_table);
+
+    return time_table;
+}
+
+/* Format 'ns' with an appropriate unit into 'buf'. */
+static const char *time_fmt(char *buf, size_t buf_sz, double ns)
+{
+    static const char *units[] = { "ns", "us", "ms", "s" };
+    size_t i;
+
+    for (i = 0; ns >= 1000 && i < ARRAY_LEN(units) - 1; ++i)
+        ns /= 1000;
+
+    snprintf(buf, buf_sz, "%.*f%s", i ? 2 : 0, ns, units[i]);
+    return buf;
+}
+
+/* Estimate the duration at 'frac' of the distribution in 'st'. */
+static double time_percentile(const struct time_stat *st, double frac)
+{
+    uint64_t seen = 0, target = (uint64_t) (frac * st->count);
+    size_t   i;
+
+    for (i = 0; i < TIME_BUCKETS; ++i) {
+        if ((seen += st->hist[i]) > target) break;
+    }
+
+    /* Report the upper bound of the bucket, within the observed range */
+    if (i >= TIME_BUCKETS - 1) return st->max;
+    return ((uint64_t) 2 << i) < st->max ? (double) ((uint64_t) 2 << i)
+                                         : st->max;
+}
+
+uint64_t exio_time_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void exio_time_end(struct exio_timer *timer)
+{
+    struct time_table *table;
+    struct time_stat  *st;
+
+    uint64_t now = exio_time_now(), ns = now - timer->start;
+    size_t   i, bucket;
+
+    if (!(table = time_table_get())) return;
+
+    /* Names are string literals, so they are identified by address */
+    i = ((uintptr_t) timer->name >> 3) & (TIME_SLOTS - 1);
+
+    for (bucket = 0; bucket < TIME_SLOTS; ++bucket, i = (i + 1) & (TIME_SLOTS - 1)) {
+        st = &table->stats[i];
+        if (st->name == timer->name || !st->name) break;
+    }
+
+    if (bucket == TIME_SLOTS) return;   // The table is full
+
+    if (!st->name) {
+        st->name = timer->name;
+        st->min = UINT64_MAX;
+    }
+
+    for (bucket = 0; bucket < TIME_BUCKETS - 1 && ns >> (bucket + 1); ++bucket);
+
+    ++st->count;
+    st->sum += ns;
+    if (ns < st->min) st->min = ns;
+    if (ns > st->max) st->max = ns;
+    ++st->hist[bucket];
+
+    if (time_interval && now - table->last_report >= time_interval)
+        exio_time_report();
+}
+
+/* Write 'st' to 'out' as a JSON object on a single line, with durations in
+   nanoseconds. */
+static bool time_json(FILE *out, const struct time_stat *st)
+{
+    const char *p;
+    long        tid = 0;
+
+#ifdef SYS_gettid
+    tid = syscall(SYS_gettid);
+#endif
+
+    fputs("{\"name\":\"", out);
+
+    for (p = st->name; *p; ++p) {
+        if (*p == '"' || *p == '\\') fputc('\\', out);
+        fputc(*p, out);
+    }
+
+    return fprintf(out, "\",\"tid\":%ld,\"n\":%llu,\"min\":%llu,\"avg\":%.0f,"
+                        "\"p50\":%.0f,\"p99\":%.0f,\"max\":%llu}\n",
+                   tid, (unsigned long long) st->count,
+                   (unsigned long long) st->min, (double) st->sum / st->count,
+                   time_percentile(st, 0.5), time_percentile(st, 0.99),
+                   (unsigned long long) st->max) > 0;
+}
+
+bool exio_time_report(void)
+{
+    struct time_table *table = time_table;
+    struct time_stat  *st;
+
+    FILE  *out = time_output;
+    char   min[16], avg[16], p50[16], p99[16], max[16];
+    size_t i;
+    bool   ret = true;
+
+    if (!table) return true;
+
+    /* Keep the lines of a report together */
+    if (out) flockfile(out);
+
+    for (i = 0; i < TIME_SLOTS; ++i) {
+        st = &table->stats[i];
+        if (!st->count) continue;
+
+        if (out) ret &= time_json(out, st);
+        else ret &= info("time: %s: n=%llu min=%s avg=%s p50=%s p99=%s max=%s",
+                    st->name, (unsigned long long) st->count,
+                    time_fmt(min, sizeof(min), st->min),
+                    time_fmt(avg, sizeof(avg), (double) st->sum / st->count),
+                    time_fmt(p50, sizeof(p50), time_percentile(st, 0.5)),
+                    time_fmt(p99, sizeof(p99), time_percentile(st, 0.99)),
+                    time_fmt(max, sizeof(max), st->max));
+
+        /* Keep the name, so that the slot stays valid for probing */
+        memset(&st->count, 0, sizeof(*st) - offsetof(struct time_stat, count));
+        st->min = UINT64_MAX;
+    }
+
+    if (out) {
+        ret &= fflush(out) == 0;
+        funlockfile(out);
+    }
+
+    table->last_report = exio_time_now();
+    return ret;
+}
+
+void exio_time_interval(unsigned ms)
+{
+    time_interval = (uint64_t) ms * 1000000;
+}
+
+void exio_time_output(FILE *out)
+{
+    time_output = out;
+}
+
+#endif /* EXIO_USE_TIMING */
@@ -5,15 +5,23 @@
  * Library containing various *ex*tensions to `stdio.h`.
  *
  * Define the macro `EXIO_USE_COLOUR` to enable coloured output with the user IO
- * functions.
+ * functions, `EXIO_USE_TIMING` to enable the timing instrumentation, and
+ * `EXIO_ALLOC_STATS` to count the heap usage of the library. These macros must
+ * be defined consistently when compiling the library itself.
  */
 
 #ifndef EXIO_H
 #define EXIO_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+#  define restrict __restrict__
+extern "C" {
+#endif
+
 /* ANSI colour codes. */
 #ifdef EXIO_USE_COLOUR
 #  define C_NORMAL    "\033[0m"       /* Reset.       */
@@ -31,17 +39,155 @@
 #  define C_HEADING
 #endif /* EXIO_USE_COLOUR */
 
+/* Branch prediction hints and attributes for error paths. */
+#ifdef __GNUC__
+#  define EXIO_LIKELY(x)    __builtin_expect(!!(x), 1)
+#  define EXIO_UNLIKELY(x)  __builtin_expect(!!(x), 0)
+#  define EXIO_COLD         __attribute__((cold, noinline, noreturn))
+#  define EXIO_PRINTF(f, a) __attribute__((format(printf, f, a)))
+#else
+#  define EXIO_LIKELY(x)    (x)
+#  define EXIO_UNLIKELY(x)  (x)
+#  define EXIO_COLD
+#  define EXIO_PRINTF(f, a)
+#endif /* __GNUC__ */
+
 /* Whether or not to echo user input when with 'getusrln()'. */
 enum input_mode {
     IN_HIDE,
     IN_SHOW
 };
 
+/* Options for 'exio_copy_tree()'. */
+enum copy_flag {
+    COPY_META = 1 << 0      /* Preserve ownership, permissions and times.   */
+};
+
+/* Options for 'exio_mirror()'. */
+enum mirror_flag {
+    MIRROR_KEEP    = 1 << 0,    /* Keep files absent from the source.           */
+    MIRROR_CONTENT = 1 << 1,    /* Compare contents rather than times.          */
+    MIRROR_META    = 1 << 2     /* Preserve ownership and permissions.          */
+};
+
+/* The changes made by 'exio_mirror()'. */
+struct mirror_summary {
+    size_t   created;       /* Files and directories added.             */
+    size_t   updated;       /* Files replaced.                          */
+    size_t   deleted;       /* Files and directories deleted.           */
+    size_t   unchanged;     /* Files left as they were.                 */
+    uint64_t bytes;         /* Data copied.                             */
+};
+
+/* Ordered output of a chunk processed by 'exio_par_lines()'. */
+struct line_out;
+
+/* Options for 'exio_writer_open()'. */
+enum writer_flag {
+    WRITER_DIRECT = 1 << 0,     /* Bypass the page cache where supported.       */
+    WRITER_SYNC   = 1 << 1,     /* Flush the data to the device on closing.     */
+    WRITER_LOW    = 1 << 2      /* Write at low priority.                       */
+};
+
+/* Priorities of writes, see 'exio_fs_admit()'. */
+enum fs_prio {
+    PRIO_LOW,       /* Shed first, such as caches and debug logs.           */
+    PRIO_NORMAL,    /* Refused when space is critically low.                */
+    PRIO_HIGH       /* Always admitted.                                     */
+};
+
+/* Information about a watched file system, see 'exio_fs_info()'. */
+struct fs_info {
+    uint64_t size;          /* Total size in bytes.                     */
+    uint64_t avail;         /* Bytes available to unprivileged users.   */
+    uint64_t files;         /* Total number of inodes.                  */
+    uint64_t files_avail;   /* Inodes available to unprivileged users.  */
+    int64_t  age_ms;        /* Time since the information was refreshed. */
+};
+
+/* A compiled path pattern, see 'exio_glob_compile()'. */
+struct exio_glob;
+
+/* A set of files followed for appended lines, see 'exio_follow_new()'. */
+struct exio_follow;
+
+/* A buffered file writer, see 'exio_writer_open()'. */
+struct exio_writer;
+
+/* A log file appended to through shared memory, see 'exio_maplog_open()'. */
+struct exio_maplog;
+
+/* Live status rows on the terminal, see 'exio_dashboard_new()'. */
+struct exio_dashboard;
+
+#ifdef EXIO_ALLOC_STATS
+/* Heap usage of the library, see 'exio_alloc_stats()'. */
+struct exio_alloc_stats {
+    size_t   current;       /* Bytes currently allocated.               */
+    size_t   peak;          /* Highest value of 'current'.              */
+    uint64_t count;         /* Allocations made.                        */
+};
+#endif
+
+/* A memory allocator, see 'exio_set_allocator()'. The size of the block is
+   passed back when it is resized or freed. */
+struct exio_allocator {
+    void *(*alloc)(size_t size, void *ctx);
+    void *(*realloc)(void *ptr, size_t old_size, size_t size, void *ctx);
+    void  (*free)(void *ptr, size_t size, void *ctx);
+    void  *ctx;             /* Passed to the functions.                 */
+};
+
+/* Resource usage of the process, see 'exio_usage_start()'. */
+struct exio_usage {
+    uint64_t time_ns;           /* Monotonic time of the sample.            */
+    uint64_t user_us;           /* CPU time in user mode.                   */
+    uint64_t sys_us;            /* CPU time in kernel mode.                 */
+    uint64_t vol_switches;      /* Voluntary context switches.              */
+    uint64_t invol_switches;    /* Involuntary context switches.            */
+    uint64_t read_bytes;        /* Bytes read, including from the cache.    */
+    uint64_t write_bytes;       /* Bytes written.                           */
+    uint64_t rss;               /* Resident memory in bytes.                */
+    size_t   fds;               /* Open file descriptors.                   */
+    size_t   threads;           /* Running threads.                         */
+};
+
+/* Severity of a message, see 'exio_journal_write()'. */
+enum msg_level {
+    LEVEL_ERROR,    /* Written with 'err()'.                                */
+    LEVEL_WARNING,  /* Written with 'warn()'.                               */
+    LEVEL_INFO      /* Written with 'info()'.                               */
+};
+
+/* A journal of messages, see 'exio_journal_open()'. */
+struct exio_journal;
+
+/* A message read from a journal, see 'exio_journal_read()'. */
+struct journal_entry {
+    enum msg_level level;
+    uint64_t       time_ns;     /* Real time at which it was written.       */
+    uint32_t       pid;         /* Process which wrote it.                  */
+    const char    *text;        /* Not null-terminated.                     */
+    size_t         len;
+};
+
+/* What is left behind by a fatal signal, see 'set_core_mode()'. */
+enum core_mode {
+    CORE_DEFAULT,   /* Dump a core without the bulk regions.                */
+    CORE_SMALL,     /* Dump only private anonymous memory.                  */
+    CORE_NONE       /* Dump no core; report the signal on stderr instead.   */
+};
+
 /*
  * Write formatted messages to stderr.
  *
  * 'format' must be a null-terminated string; the syntax is the same as with
- * 'printf'. These functions write a trailing newline.
+ * 'printf'. These functions write a trailing newline. Messages are written at
+ * once with a single system call (if 'stderr' is unbuffered, as by default),
+ * and are not interleaved with output from other threads. Messages longer than
+ * 1 KiB are formatted in a scratch buffer of the calling thread, which is
+ * allocated on first use and kept for later messages. Messages may instead be
+ * buffered, see 'exio_msg_buffer()'.
  *
  * Return true on success.
  * Return false on output failure.
@@ -51,6 +197,206 @@ bool err(const char *restrict format, ...);
 bool warn(const char *restrict format, ...);
 bool info(const char *restrict format, ...);
 
+/*
+ * Add the field 'key' with value 'val' to the context of the calling thread.
+ *
+ * The context fields are shown after the prefix of every message written by the
+ * thread with 'err()', 'warn()' and 'info()', as in "[key=val key=val] ". They
+ * are copied, and removed in reverse order with 'exio_ctx_pop()'. A context
+ * holds up to 8 fields and 256 characters.
+ *
+ * 'key' and 'val' must be null-terminated strings.
+ *
+ * Returns true on success.
+ * Returns false and sets errno if the context is full.
+ *
+ */
+bool exio_ctx_push(const char *key, const char *val);
+
+/*
+ * Remove the last field added to the context of the calling thread, if any.
+ *
+ */
+void exio_ctx_pop(void);
+
+/*
+ * Buffer the messages written with 'err()', 'warn()' and 'info()' in up to
+ * 'size' bytes, so that bursts of messages cost a single system call.
+ *
+ * The buffer is written out once it holds 'max_lines' messages, or when the
+ * oldest message is 'max_ms' milliseconds old; 0 disables either limit. Errors
+ * are always written out immediately, along with any messages before them, as
+ * is the buffer before a prompt, at exit, and on a signal handled by a function
+ * set with 'set_handler_segv()' or 'set_handler_term()'. Messages which are
+ * larger than the buffer are written directly.
+ *
+ * If 'size' is 0, the buffer is written out and messages are no longer
+ * buffered (the default). A buffer replaced by a later call is kept for reuse
+ * rather than freed, as a signal handler may still be writing it out.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_msg_buffer(size_t size, unsigned max_lines, unsigned max_ms);
+
+/*
+ * Write out the messages buffered with 'exio_msg_buffer()', if any.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on output failure.
+ *
+ */
+bool exio_msg_flush(void);
+
+/*
+ * Append the messages written with 'err()', 'warn()' and 'info()' to 'l'
+ * instead of writing them to stderr, or stop doing so if NULL.
+ *
+ * Buffered messages are written out first, see 'exio_msg_buffer()'.
+ *
+ */
+void exio_msg_maplog(struct exio_maplog *l);
+
+/*
+ * Also record the messages written with 'err()', 'warn()' and 'info()' in 'j',
+ * or stop doing so if NULL.
+ *
+ * The text is recorded without the prefix of the level, but with the context
+ * fields, see 'exio_ctx_push()'. The message functions fail if it cannot be
+ * recorded.
+ *
+ */
+void exio_msg_journal(struct exio_journal *j);
+
+/*
+ * Abort the program if 'cond' is false, after writing an error message with
+ * 'err()' which includes the source location and 'cond' itself.
+ *
+ * The failure branch is marked as unlikely, and the message is formatted out of
+ * line so as not to burden the calling code. 'EXIO_CHECK_MSG()' additionally
+ * writes a message in the same format as 'err()'. The program is aborted with
+ * 'abort()', so handlers set with 'set_handler_term()' are run.
+ *
+ * 'EXIO_ASSERT()' is the same as 'EXIO_CHECK()', but expands to nothing if
+ * 'NDEBUG' is defined.
+ *
+ */
+#define EXIO_CHECK(cond)                                                    \
+    do {                                                                    \
+        if (EXIO_UNLIKELY(!(cond)))                                         \
+            exio_check_fail(__FILE__, __LINE__, #cond);                     \
+    } while (0)
+
+#define EXIO_CHECK_MSG(cond, ...)                                           \
+    do {                                                                    \
+        if (EXIO_UNLIKELY(!(cond)))                                         \
+            exio_check_failf(__FILE__, __LINE__, #cond, __VA_ARGS__);       \
+    } while (0)
+
+#ifdef NDEBUG
+#  define EXIO_ASSERT(cond)     ((void) 0)
+#else
+#  define EXIO_ASSERT(cond)     EXIO_CHECK(cond)
+#endif
+
+void exio_check_fail(const char *file, int line, const char *cond) EXIO_COLD;
+void exio_check_failf(const char *file, int line, const char *cond,
+                      const char *restrict format, ...)
+                      EXIO_COLD EXIO_PRINTF(4, 5);
+
+/*
+ * Use 'a' for all memory allocated by the library from now on, or the standard
+ * 'malloc()' family if NULL (the default).
+ *
+ * Memory is always freed by the allocator it came from, so 'a' must remain
+ * valid as long as memory allocated with it is in use, including internal
+ * caches. 'alloc' must return memory aligned as by 'malloc()', and the functions
+ * must be thread-safe. Secrets are not affected, as they are allocated from
+ * locked memory. The input returned by 'exio_getusrln()' may come from another
+ * allocator passed to it instead.
+ *
+ * 'get_xdg_path()', 'fsize()', 'exio_fs_admit()' and 'exio_writer_write()'
+ * never allocate memory. Neither do the message functions and 'mkpath()' once
+ * the scratch buffer of the calling thread exists (and the parent directory is
+ * cached, for the latter); temporary buffers come from this buffer, which only
+ * grows to fit the largest recent use and is freed when the thread exits.
+ *
+ */
+void exio_set_allocator(const struct exio_allocator *a);
+
+#ifdef EXIO_ALLOC_STATS
+/*
+ * Copy the heap usage of the library into 'stats'.
+ *
+ * All memory allocated by the library through its allocator is counted,
+ * process-wide, except for the input returned by 'getusrln()', which belongs
+ * to the caller, and the secrets, which are not on the heap. Memory allocated
+ * within the C library, such as for directory streams, is not. If 'reset', the
+ * peak is then lowered to the current usage and the count set to 0, so that
+ * the footprint of a single call can be measured.
+ *
+ * Only available with 'EXIO_ALLOC_STATS', as counting adds atomic operations
+ * on shared counters to every allocation.
+ *
+ */
+void exio_alloc_stats(struct exio_alloc_stats *stats, bool reset);
+#endif
+
+/*
+ * Show 'rows' live status rows at the bottom of the terminal, below the
+ * messages written with 'err()', 'warn()' and 'info()'.
+ *
+ * The rows are set with 'exio_dashboard_set()', and drawn on 'stderr' at most
+ * every 'interval_ms' milliseconds. Only the characters which changed since the
+ * last draw are written, with a single system call. Messages scroll above the
+ * rows, which are drawn again below them. Rows are cut to the width of the
+ * terminal, and only one dashboard can exist at a time.
+ *
+ * Returns a new dashboard on success.
+ * Returns NULL and sets errno on failure, or if 'stderr' is not a terminal.
+ *
+ * The returned dashboard should be freed with 'exio_dashboard_free()' after
+ * use, which leaves the final state of the rows on the terminal.
+ *
+ */
+struct exio_dashboard *exio_dashboard_new(size_t rows, unsigned interval_ms);
+
+/*
+ * Draw any remaining changes to the rows of 'd', and free it.
+ *
+ */
+void exio_dashboard_free(struct exio_dashboard *d);
+
+/*
+ * Set the contents of the row 'row' of 'd' to a formatted string.
+ *
+ * 'format' has the same syntax as with 'printf', and the result may contain the
+ * 'C_*' colour codes, each of which sets the style of the following characters.
+ * Other control characters are shown as spaces. Every character is assumed to
+ * be one column wide, so wide (such as CJK) and combining characters misalign
+ * the row; only ASCII and other single-width text is supported. The row is
+ * drawn immediately if the interval of 'd' has passed since the last draw, and
+ * by a later call to this function or 'exio_dashboard_draw()' otherwise. This
+ * function can be called from several threads.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_dashboard_set(struct exio_dashboard *d, size_t row,
+                        const char *restrict format, ...) EXIO_PRINTF(3, 4);
+
+/*
+ * Draw the changes to the rows of 'd' regardless of its interval, such as
+ * periodically to show changes which were throttled.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_dashboard_draw(struct exio_dashboard *d);
+
 /*
  * Obtain confirmation from the user while displaying 'prompt'.
  *
@@ -75,15 +421,71 @@ bool confirm(const char *prompt);
  *
  * 'prompt' must be a null-terminated string.
  *
+ * Besides reading the input, writing the prompt takes one system call. Hiding
+ * the input takes four more: to get and set the terminal attributes, and to
+ * write the newline which was not echoed.
+ *
  * Returns pointer to read data on success.
  * Returns NULL and sets errno on failure.
  * Returns NULL and sets the 'stdin' EOF indicator if EOF was encountered.
  *
- * The returned pointer should be freed after use.
+ * The returned pointer should be freed after use with the 'free' function of
+ * the allocator set with 'exio_set_allocator()' when it was called, as
+ * described for 'exio_getusrln()'; with the default allocator, this is just
+ * 'free()'. It should be erased first if the input is sensitive.
  *
  */
 char *getusrln(const char *prompt, size_t *input_len, enum input_mode mode);
 
+/*
+ * The same as 'getusrln()', but the input is read into memory from 'a', or the
+ * allocator set with 'exio_set_allocator()' if NULL. This is the only allocator
+ * taken per call, as the input is the only memory the library hands over to the
+ * caller; anything allocated internally still comes from the allocator set with
+ * 'exio_set_allocator()'.
+ *
+ * The returned block is of size '*input_len' + 1, or the string length + 1 if
+ * 'input_len' is NULL, and must be freed with 'a->free(ptr, size, a->ctx)'
+ * rather than 'free()'. Intermediate buffers are erased before being freed.
+ *
+ */
+char *exio_getusrln(const char *prompt, size_t *input_len, enum input_mode mode,
+                    const struct exio_allocator *a);
+
+/*
+ * Read a secret (such as a credential) from the file at 'path'.
+ *
+ * The secret is read without stdio buffering into memory which is locked into
+ * RAM and excluded from core dumps, and sets 'secret_len' (if not NULL) to its
+ * length. A single trailing newline is ignored, and the secret is always
+ * null-terminated. Secrets of unknown size (as from pipes) are limited to
+ * 64 KiB.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ * Returns pointer to the secret on success.
+ * Returns NULL and sets errno on failure.
+ *
+ * The returned pointer should be freed with 'exio_free_secret()' after use.
+ *
+ */
+char *exio_read_secret(const char *path, size_t *secret_len);
+
+/*
+ * The same as 'exio_read_secret()', but read from 'fd' until EOF, or up to the
+ * size of 'fd' if it has one (as regular files do).
+ *
+ * 'fd' must be a valid file descriptor open for reading.
+ *
+ */
+char *exio_read_secret_fd(int fd, size_t *secret_len);
+
+/*
+ * Erase and free 'secret', as returned by 'exio_read_secret()'.
+ *
+ */
+void exio_free_secret(char *secret);
+
 /*
  * Build a standard application path and copy it into 'path'.
  *
@@ -94,6 +496,8 @@ char *getusrln(const char *prompt, size_t *input_len, enum input_mode mode);
  * 'path' must be an array of minimum size 'PATH_MAX' + 1. Directory parameters
  * can be passed without leading or trailing path separator '/' characters.
  *
+ * Makes no system calls.
+ *
  * Returns 0 on success.
  * Returns -1 and sets errno on overlong path error.
  * Returns -2 on environment error.
@@ -102,11 +506,56 @@ char *getusrln(const char *prompt, size_t *input_len, enum input_mode mode);
 int get_xdg_path(char *restrict path, const char *sub_dir,
                  const char *xdg_dir, const char *fallback_dir);
 
+/*
+ * Get a descriptor for the directory 'path' from the process-wide cache.
+ *
+ * The cache holds 'O_PATH' descriptors (usable with the '*at()' functions) for
+ * recently used directories, keyed by path, and is shared by the path-based
+ * functions of this library. Missing directories are opened relative to their
+ * deepest cached ancestor. Paths are compared lexically, after removing
+ * redundant '/' characters and "." components.
+ *
+ * 'path' must be a null-terminated string representing an absolute path without
+ * ".." components.
+ *
+ * Returns a file descriptor on success.
+ * Returns -1 and sets errno on failure.
+ *
+ * The returned descriptor must be released with 'exio_dircache_put()', and must
+ * not be closed.
+ *
+ */
+int exio_dircache_get(const char *path);
+
+/*
+ * Release 'fd', as returned by 'exio_dircache_get()'.
+ *
+ */
+void exio_dircache_put(int fd);
+
+/*
+ * Remove 'path' and the directories below it from the directory cache, such as
+ * after renaming or removing it. Descriptors in use remain valid until
+ * released.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ */
+void exio_dircache_invalidate(const char *path);
+
+/*
+ * Limit the directory cache to 'max_fds' unused descriptors (64 by default).
+ *
+ */
+void exio_dircache_limit(size_t max_fds);
+
 /*
  * Recursively create 'path' à la 'mkdir -p'.
  *
  * Already existing directories in the path (or its entirety) are ignored, and
- * directories are created with permissions 0777 - umask.
+ * directories are created with permissions 0777 - umask. The parent directory
+ * is looked up in the directory cache, so an existing path is normally checked
+ * with a single system call.
  *
  * 'path' must be a null-terminated string representing an absolute path. It is
  * modified during execution, and restored afterwards regardless of errors.
@@ -117,10 +566,543 @@ int get_xdg_path(char *restrict path, const char *sub_dir,
  */
 bool mkpath(char *path);
 
+/*
+ * The same as 'mkpath()', but 'path' may be relative, in which case it is
+ * interpreted relative to the directory 'dirfd' (or the working directory if
+ * 'dirfd' is 'AT_FDCWD').
+ *
+ */
+bool mkpathat(int dirfd, char *path);
+
+/*
+ * Recursively copy the directory 'src' to 'dst' à la 'cp -r'.
+ *
+ * 'dst' is created with 'mkpath()' if needed; if it already exists the contents
+ * of 'src' are copied into it. Files are cloned when the file system allows it,
+ * and otherwise copied in the kernel where possible. Regular files, directories
+ * and symbolic links are copied, and other file types are ignored. The copy is
+ * performed by 'nthreads' threads, or one per online CPU if 0. 'flags' is a
+ * combination of 'enum copy_flag' values.
+ *
+ * 'src' and 'dst' must be null-terminated strings.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure. As much of the tree as possible is
+ * still copied, and errno reflects the first error encountered.
+ *
+ */
+bool exio_copy_tree(const char *src, const char *dst, int flags,
+                    unsigned nthreads);
+
+/*
+ * Incrementally update the directory 'dst' to mirror 'src'.
+ *
+ * Both trees are walked in parallel by 'nthreads' threads (or one per online
+ * CPU if 0), and only regular files that differ in size or modification time
+ * are copied, atomically replacing their counterparts in 'dst'. Files absent
+ * from 'src' are deleted from 'dst', which is created with 'mkpath()' if needed.
+ * Copied files keep the times of the source, so that unchanged files are
+ * recognised next time. 'flags' is a combination of 'enum
+ * mirror_flag' values. If 'summary' is not NULL, it is set to the changes made.
+ *
+ * With 'MIRROR_META', the owner and mode of every directory are synced as well,
+ * including those which already exist. Modes are applied once the directories
+ * are filled, so read-only directories are mirrored too.
+ *
+ * 'src' and 'dst' must be null-terminated strings.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure. As much of the tree as possible is
+ * still mirrored, and errno reflects the first error encountered.
+ *
+ */
+bool exio_mirror(const char *src, const char *dst, int flags,
+                 struct mirror_summary *summary, unsigned nthreads);
+
+/*
+ * Process the lines of the file at 'path' in parallel with 'func'.
+ *
+ * The file is mapped into memory and split into chunks at line boundaries,
+ * which are processed by 'nthreads' threads (or one per online CPU if 0). 'func'
+ * is called with each line (without the trailing newline, and not
+ * null-terminated) and 'arg', concurrently from several threads. Lines of a
+ * chunk are processed in order, but chunks are not.
+ *
+ * If 'out_fd' is not -1, 'func' can write output with 'exio_line_out()' through
+ * 'out', which is written to 'out_fd' in the order of the file. Otherwise 'out'
+ * is NULL.
+ *
+ * 'func' returns false to stop processing; 'errno' may be set to the cause.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_par_lines(const char *path, unsigned nthreads,
+                    bool (*func)(const char *line, size_t len,
+                                 struct line_out *out, void *arg),
+                    void *arg, int out_fd);
+
+/*
+ * Append 'len' bytes of 'data' to 'out', within a call to 'func' from
+ * 'exio_par_lines()'.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_line_out(struct line_out *out, const void *data, size_t len);
+
+/*
+ * Compile the path pattern 'pattern' for use with 'exio_glob()'.
+ *
+ * The pattern is split into components by '/' characters, which are matched
+ * with 'fnmatch()' as with 'glob()', except that the component "**" matches any
+ * number of directories. As with '*', hidden files must be matched explicitly.
+ * A pattern can have up to 63 components.
+ *
+ * 'pattern' must be a null-terminated string.
+ *
+ * Returns the compiled pattern on success.
+ * Returns NULL and sets errno on failure.
+ *
+ * The returned pattern should be freed with 'exio_glob_free()' after use.
+ *
+ */
+struct exio_glob *exio_glob_compile(const char *pattern);
+
+/*
+ * Free the compiled pattern 'g'.
+ *
+ */
+void exio_glob_free(struct exio_glob *g);
+
+/*
+ * Test whether 'path' matches the compiled pattern 'g'.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ */
+bool exio_glob_match(const struct exio_glob *g, const char *path);
+
+/*
+ * Find the paths under the directory 'root' matching the compiled pattern 'g'
+ * à la 'find'.
+ *
+ * The tree is walked by 'nthreads' threads (or one per online CPU if 0), and
+ * only enters directories where the pattern can still match. 'func' is called
+ * with each matching path (relative to 'root') and 'arg', concurrently from
+ * several threads and in no particular order. Symbolic links are not followed.
+ *
+ * 'func' returns false to stop the search, which then fails with 'ECANCELED'.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure. errno reflects the first error
+ * encountered, but the search continues past unreadable directories.
+ *
+ */
+bool exio_glob(const struct exio_glob *g, const char *root,
+               bool (*func)(const char *path, void *arg), void *arg,
+               unsigned nthreads);
+
+/*
+ * Update the CRC32C checksum 'crc' with 'len' bytes of 'data'.
+ *
+ * The initial checksum is 0. The CRC32C instructions of the CPU are used when
+ * available, which makes this suitable for hashing large amounts of data, such
+ * as for content-addressed cache keys. It is not a cryptographic hash.
+ *
+ * Returns the updated checksum.
+ *
+ */
+uint32_t exio_crc32c(uint32_t crc, const void *data, size_t len);
+
+/*
+ * Compute the CRC32C checksum of the contents of 'fd' and store it in 'crc'.
+ *
+ * Large files are mapped into memory rather than read; the file is hashed from
+ * the start in either case. 'fd' must be a valid file descriptor open for
+ * reading.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_hash_fd(int fd, uint32_t *crc);
+
+/*
+ * The same as 'exio_hash_fd()', but for the file at 'path'.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ */
+bool exio_hash_file(const char *path, uint32_t *crc);
+
+/*
+ * Compute the CRC32C checksums of the 'n' files in 'paths' into 'crcs', using
+ * 'nthreads' threads (or one per online CPU if 0).
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure. The checksums of the files that could
+ * not be read are set to 0, and errno reflects the first error encountered.
+ *
+ */
+bool exio_hash_files(const char *const *paths, size_t n, uint32_t *crcs,
+                     unsigned nthreads);
+
+/*
+ * Create an empty set of files to follow à la 'tail -F'.
+ *
+ * Returns a new set on success.
+ * Returns NULL and sets errno on failure.
+ *
+ * The returned set should be freed with 'exio_follow_free()' after use.
+ *
+ */
+struct exio_follow *exio_follow_new(void);
+
+/*
+ * Free the set of followed files 'f'.
+ *
+ */
+void exio_follow_free(struct exio_follow *f);
+
+/*
+ * Add the file at 'path' to the set 'f'.
+ *
+ * 'func' is called with 'arg' and each line appended to the file (without the
+ * trailing newline, and not null-terminated), starting at the end of the file
+ * if 'from_end' and at its start otherwise. The file may not exist yet. If the
+ * file is rotated (its path refers to a new file), the rest of the old file is
+ * delivered and the new file is read from its start. If it is truncated, it is
+ * read again from its start. A line of 1 MiB or more may be delivered in
+ * several parts, all but the last of which are at least 1 MiB long.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_follow_add(struct exio_follow *f, const char *path, bool from_end,
+                     bool (*func)(const char *line, size_t len, void *arg),
+                     void *arg);
+
+/*
+ * Wait up to 'timeout_ms' milliseconds (or indefinitely if negative) for the
+ * files in 'f' to change, and deliver the new lines.
+ *
+ * Changes are detected with inotify where available, and every file is also
+ * checked once a second, so that files in directories created later are found;
+ * this function returns when the next check is due at the latest. 'func'
+ * returns false to stop following, in which case this function fails with
+ * 'ECANCELED'.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_follow_wait(struct exio_follow *f, int timeout_ms);
+
+/*
+ * Follow the file at 'path' from its end until 'func' returns false or an error
+ * occurs, à la 'tail -F'. See 'exio_follow_add()'.
+ *
+ * Returns false and sets errno.
+ *
+ */
+bool exio_follow(const char *path,
+                 bool (*func)(const char *line, size_t len, void *arg),
+                 void *arg);
+
+/*
+ * Copy everything from 'in_fd' to each of the 'n' descriptors in 'out_fds' à la
+ * 'tee', until EOF.
+ *
+ * If 'in_fd' is a pipe, the data is duplicated and moved in the kernel without
+ * being copied through user space, where the outputs allow it: a single output,
+ * or several regular files or block devices. Otherwise it is read once into a
+ * buffer of 1 MiB and written to every output; outputs proceed independently,
+ * so a slow pipe or socket does not hold up the others, and reading pauses
+ * while the slowest output is a full buffer behind.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_tee(int in_fd, const int *out_fds, size_t n);
+
+/*
+ * Watch the file system containing 'path' for free space, to decide whether
+ * writes are admitted with 'exio_fs_admit()'.
+ *
+ * The free space of watched file systems is refreshed by a background thread
+ * at the interval set with 'exio_fs_interval()'. Writes of priority 'PRIO_LOW'
+ * are shed while less than 'shed_below' bytes are available, and writes of
+ * priority 'PRIO_NORMAL' are refused while less than 'refuse_below' bytes are
+ * available. Watching a file system again replaces its thresholds. At most 32
+ * file systems can be watched, for the lifetime of the process.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ * Returns an identifier for the file system on success.
+ * Returns -1 and sets errno on failure.
+ *
+ */
+int exio_fs_watch(const char *path, uint64_t shed_below, uint64_t refuse_below);
+
+/*
+ * Find the watched file system containing the file open as 'fd'.
+ *
+ * Returns the identifier of the file system if it is watched.
+ * Returns -1 otherwise, or if 'fd' is invalid.
+ *
+ */
+int exio_fs_find(int fd);
+
+/*
+ * Check whether a write of priority 'prio' to the file system 'fs' is admitted,
+ * as of the last refresh.
+ *
+ * This is a single atomic load, so it can be called before every write.
+ *
+ * Returns true if the write is admitted, or if 'fs' is negative.
+ * Returns false otherwise, and sets errno to EINVAL if 'fs' is not a watched
+ * file system.
+ *
+ */
+bool exio_fs_admit(int fs, enum fs_prio prio);
+
+/*
+ * Copy the information about the file system 'fs' into 'info', after
+ * refreshing it if 'refresh'.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure. 'info' is still set to the previous
+ * information if refreshing failed.
+ *
+ */
+bool exio_fs_info(int fs, struct fs_info *info, bool refresh);
+
+/*
+ * Refresh the watched file systems every 'ms' milliseconds (1000 by default),
+ * or only on demand if 'ms' is 0.
+ *
+ */
+void exio_fs_interval(unsigned ms);
+
+/*
+ * Create or truncate the file at 'path' for high-throughput writing.
+ *
+ * Data is collected in two aligned buffers of 'buf_sz' bytes (or 4 MiB if 0):
+ * while one is filled by 'exio_writer_write()', the other is written by a
+ * background thread. 'flags' is a combination of 'enum writer_flag' values;
+ * 'WRITER_DIRECT' is ignored if the file system does not support direct IO. If
+ * 'prealloc' is positive, that much space is reserved for the file in advance
+ * without changing its size. If the file system is watched with
+ * 'exio_fs_watch()', writes must be admitted at normal priority (or low with
+ * 'WRITER_LOW'), and fail with 'ENOSPC' otherwise.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ * Returns a writer on success.
+ * Returns NULL and sets errno on failure.
+ *
+ * The returned writer must be closed with 'exio_writer_close()'.
+ *
+ */
+struct exio_writer *exio_writer_open(const char *path, int flags,
+                                     size_t buf_sz, off_t prealloc);
+
+/*
+ * Write 'len' bytes of 'data' to 'w'.
+ *
+ * Only blocks if both buffers are full. Errors from the background thread are
+ * reported by later calls.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_writer_write(struct exio_writer *w, const void *data, size_t len);
+
+/*
+ * Write the data buffered in 'w' to its file, and wait for completion.
+ *
+ * With direct IO, a trailing partial block remains buffered.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_writer_flush(struct exio_writer *w);
+
+/*
+ * Write the remaining data in 'w', close its file and free it.
+ *
+ * With 'WRITER_SYNC', the data is flushed to the device before returning.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_writer_close(struct exio_writer *w);
+
+/*
+ * Open or create the log file at 'path' for appending through shared memory.
+ *
+ * Appending with 'exio_maplog_append()' reserves space with an atomic addition
+ * on the length kept in the header of the file, and copies the data into the
+ * file mapping, so that any number of threads and processes can append at once
+ * without system calls. The file is extended and mapped in windows of 'window'
+ * bytes (or 64 MiB if 0), and holds at most 'max' bytes of data (or 16 GiB if
+ * 0, 256 MiB on 32-bit systems). Data reaches the file even if the process
+ * crashes, but only reaches the device on 'exio_maplog_sync()' or when the
+ * system writes back the pages.
+ *
+ * The file holds a 64 KiB header, followed by the data in order of reservation
+ * and padded with null bytes. Data reserved by a process which crashed before
+ * copying it is left as null bytes. Only an empty file is turned into a log;
+ * any other file which is not already one is left untouched.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ * Returns a log on success.
+ * Returns NULL and sets errno on failure, or to EINVAL if the file is not such
+ * a log.
+ *
+ * The returned log must be closed with 'exio_maplog_close()'.
+ *
+ */
+struct exio_maplog *exio_maplog_open(const char *path, size_t window,
+                                     size_t max);
+
+/*
+ * Append 'len' bytes of 'data' to 'l'.
+ *
+ * Only makes system calls to map the next window, which one caller does for
+ * all others.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure, or if the log is full.
+ *
+ */
+bool exio_maplog_append(struct exio_maplog *l, const void *data, size_t len);
+
+/*
+ * Flush the data appended to 'l' by any process to the device.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_maplog_sync(struct exio_maplog *l);
+
+/*
+ * Unmap and close 'l', and free it.
+ *
+ * 'l' must not be used for messages, see 'exio_msg_maplog()'.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_maplog_close(struct exio_maplog *l);
+
+/*
+ * Open or create the journal of messages at 'path' for appending.
+ *
+ * The journal is a sequence of records, each a header followed by the text
+ * padded to 8 bytes. The header holds the length, a CRC32C of the record, the
+ * time, the level and the process, so that a record torn by a crash or power
+ * loss is detected. A sync marker record is written at the start and every
+ * 64 KiB, from which reading resumes after damage.
+ *
+ * Before appending, the journal is recovered: every record is validated in a
+ * single pass over a mapping of the file, using the CRC32C instructions of the
+ * CPU where available, and the file is truncated at the first invalid record
+ * which no sync marker follows, such as one torn by a crash. Only one journal
+ * may be open on a file at a time, which is enforced with an exclusive
+ * 'flock()' held until it is closed.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ * Returns a journal on success.
+ * Returns NULL and sets errno on failure, to EWOULDBLOCK if the journal is
+ * already open, or to EINVAL if the file is not a journal.
+ *
+ * The returned journal must be closed with 'exio_journal_close()'.
+ *
+ */
+struct exio_journal *exio_journal_open(const char *path);
+
+/*
+ * Append a record of the message 'text' of 'len' bytes and level 'level' to 'j'.
+ *
+ * The record is written with a single system call, and is only on the device
+ * after 'exio_journal_sync()'.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_journal_write(struct exio_journal *j, enum msg_level level,
+                        const char *text, size_t len);
+
+/*
+ * Flush the records of 'j' to the device.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_journal_sync(struct exio_journal *j);
+
+/*
+ * Close 'j' and free it.
+ *
+ * 'j' must not be used for messages, see 'exio_msg_journal()'.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_journal_close(struct exio_journal *j);
+
+/*
+ * Call 'func' with 'arg' for each message in the journal at 'path', in order,
+ * until it returns false.
+ *
+ * Invalid records are skipped up to the next sync marker. The text of 'entry'
+ * is only valid during the call.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure, or if 'func' returned false.
+ *
+ */
+bool exio_journal_read(const char *path,
+                       bool (*func)(const struct journal_entry *entry,
+                                    void *arg),
+                       void *arg);
+
+/*
+ * Write the messages in the journal at 'path' to 'out', as 'err()', 'warn()'
+ * and 'info()' would have.
+ *
+ * 'path' must be a null-terminated string.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_journal_export(const char *path, FILE *out);
+
 /*
  * Obtain the file size of 'fd'.
  *
- * 'fd' must be a valid file descriptor.
+ * 'fd' must be a valid file descriptor. Makes a single system call.
  *
  * Returns a positive number on success.
  * Returns -1 and may set errno on failure.
@@ -128,6 +1110,33 @@ bool mkpath(char *path);
  */
 off_t fsize(int fd);
 
+/*
+ * Report the resource usage of the process every 'interval_ms' milliseconds
+ * from a background thread.
+ *
+ * The usage is sampled from '/proc/self/stat', '/proc/self/io' and
+ * '/proc/self/fd', which are kept open, and 'getrusage()'; fields which cannot
+ * be read are 0. 'func' is called with 'arg', the usage of the process and its
+ * change since the last report ('rss', 'fds' and 'threads' are not changes, and
+ * 'time_ns' is the length of the interval). If 'func' is NULL, the usage and
+ * rates are written with 'info()' on a single line. Only one reporter can run
+ * at a time.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_usage_start(unsigned interval_ms,
+                      void (*func)(const struct exio_usage *total,
+                                   const struct exio_usage *delta, void *arg),
+                      void *arg);
+
+/*
+ * Stop the reporter started with 'exio_usage_start()', if any.
+ *
+ */
+void exio_usage_stop(void);
+
 /*
  * Set 'func' as the handler for SIGSEGV, with the signal as argument.
  *
@@ -148,10 +1157,136 @@ void set_handler_segv(void (*func)(int signo));
  */
 void set_handler_term(void (*func)(int signo));
 
+/*
+ * Register the memory region at 'addr' of size 'len' as bulk memory.
+ *
+ * Bulk regions (such as large caches) are immediately excluded from core dumps.
+ * Only the pages entirely contained in the region are affected, so 'addr' and
+ * 'len' should normally be page aligned, as with memory obtained from 'mmap'.
+ * At most 64 regions can be registered at once.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool exio_bulk_add(void *addr, size_t len);
+
+/*
+ * Unregister the bulk region starting at 'addr', and include it in core dumps
+ * again.
+ *
+ * Returns true on success.
+ * Returns false and sets errno if 'addr' is not registered.
+ *
+ */
+bool exio_bulk_remove(void *addr);
+
+/*
+ * Choose what is left behind when the program is killed by a fatal signal.
+ *
+ * 'CORE_SMALL' adjusts the kernel coredump filter to omit shared and
+ * file-backed memory, and 'CORE_NONE' disables core dumps altogether. The
+ * latter sets the core size limit to 0 and, on Linux, also marks the process
+ * as not dumpable, since a core pattern piping to a program ignores the limit;
+ * this also keeps other processes of the user from attaching with ptrace. With
+ * 'CORE_NONE', handlers set with 'set_handler_segv()' and 'set_handler_term()'
+ * report the signal on stderr before running. Bulk regions are never dumped.
+ *
+ * Returns true on success.
+ * Returns false and sets errno on failure.
+ *
+ */
+bool set_core_mode(enum core_mode mode);
+
 /*
  * Reset the handling for signal 'sig'.
  *
  */
 void reset_handler(int signo);
 
+/*
+ * Time the enclosing scope under 'name', which must be a string literal, or at
+ * least stay at the same address, as names are identified by their address.
+ *
+ * Durations are measured with the monotonic clock, and accumulated per name
+ * (as count, minimum, maximum, total and a logarithmic histogram) in a table
+ * local to the calling thread. At most 64 names are tracked per thread. The
+ * accumulated statistics are written with 'info()' by 'exio_time_report()', at
+ * the interval set with 'exio_time_interval()' and when the thread exits.
+ *
+ * Expands to nothing unless 'EXIO_USE_TIMING' is defined.
+ *
+ */
+#ifdef EXIO_USE_TIMING
+#  define EXIO_CAT_(a, b)   a ## b
+#  define EXIO_CAT(a, b)    EXIO_CAT_(a, b)
+
+struct exio_timer {
+    const char *name;
+    uint64_t    start;
+};
+
+uint64_t exio_time_now(void);
+void exio_time_end(struct exio_timer *timer);
+
+#  ifdef __cplusplus
+struct exio_time_scope {
+    exio_timer timer;
+
+    explicit exio_time_scope(const char *name)
+    {
+        timer.name = name;
+        timer.start = exio_time_now();
+    }
+
+    ~exio_time_scope() { exio_time_end(&timer); }
+};
+
+#    define EXIO_TIME_SCOPE(name)                                   \
+         exio_time_scope EXIO_CAT(exio_timer_, __LINE__)(name)
+#  else
+#    define EXIO_TIME_SCOPE(name)                                   \
+         struct exio_timer EXIO_CAT(exio_timer_, __LINE__)          \
+         __attribute__((cleanup(exio_time_end))) =                  \
+             { (name), exio_time_now() }
+#  endif /* __cplusplus */
+
+/*
+ * Write and reset the timing statistics of the calling thread.
+ *
+ * Returns true on success.
+ * Returns false on output failure.
+ *
+ */
+bool exio_time_report(void);
+
+/*
+ * Automatically report the timing statistics of each thread every 'ms'
+ * milliseconds, or never if 'ms' is 0 (the default).
+ *
+ * The interval is checked when a timed scope ends.
+ *
+ */
+void exio_time_interval(unsigned ms);
+
+/*
+ * Write the timing statistics to 'out' rather than with 'info()', or with
+ * 'info()' again if 'out' is NULL.
+ *
+ * The statistics are written in a machine-readable format, for comparison
+ * between builds: one JSON object per name and thread on each line, with the
+ * fields "name", "tid", "n", "min", "avg", "p50", "p99" and "max". Durations
+ * are in nanoseconds.
+ *
+ */
+void exio_time_output(FILE *out);
+#else
+#  define EXIO_TIME_SCOPE(name)     ((void) 0)
+#endif /* EXIO_USE_TIMING */
+
+#ifdef __cplusplus
+}
+#  undef restrict
+#endif
+
 #endif /* EXIO_H */
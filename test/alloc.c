@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/*
+ * Heap usage of the library.
+ *
+ * The hot functions must not allocate once warmed up. The peak footprint of
+ * each function is written to stdout, one line per function.
+ *
+ * The allocation functions of the C library are interposed to count them, in
+ * the manner of an 'LD_PRELOAD' shim, so that memory allocated within the C
+ * library on behalf of the library (by stdio or directory streams, say) is
+ * counted as well. They forward to the internal functions of glibc, as
+ * 'dlsym()' may itself allocate.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void  __libc_free(void *ptr);
+
+static struct {
+    size_t   current, peak;
+    uint64_t count;
+} heap;
+
+static void heap_add(void *ptr)
+{
+    size_t cur, peak;
+
+    if (!ptr) return;
+
+    cur = __atomic_add_fetch(&heap.current, malloc_usable_size(ptr),
+                             __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&heap.peak, __ATOMIC_RELAXED);
+
+    while (cur > peak
+           && !__atomic_compare_exchange_n(&heap.peak, &peak, cur, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    __atomic_add_fetch(&heap.count, 1, __ATOMIC_RELAXED);
+}
+
+static void heap_sub(void *ptr)
+{
+    if (ptr)
+        __atomic_sub_fetch(&heap.current, malloc_usable_size(ptr),
+                           __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+
+    heap_add(ptr);
+    return ptr;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *ptr = __libc_calloc(n, size);
+
+    heap_add(ptr);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    size_t old = ptr ? malloc_usable_size(ptr) : 0;
+    void  *new = __libc_realloc(ptr, size);
+
+    if (new || !size) __atomic_sub_fetch(&heap.current, old, __ATOMIC_RELAXED);
+    heap_add(new);
+
+    return new;
+}
+
+void free(void *ptr)
+{
+    heap_sub(ptr);
+    __libc_free(ptr);
+}
+
+static size_t base;
+
+static void start(void)
+{
+    base = __atomic_load_n(&heap.current, __ATOMIC_RELAXED);
+    __atomic_store_n(&heap.peak, base, __ATOMIC_RELAXED);
+    __atomic_store_n(&heap.count, 0, __ATOMIC_RELAXED);
+}
+
+/* Get the allocations made since 'start()', and report the footprint. */
+static uint64_t stop(const char *name)
+{
+    size_t   peak = __atomic_load_n(&heap.peak, __ATOMIC_RELAXED);
+    uint64_t count = __atomic_load_n(&heap.count, __ATOMIC_RELAXED);
+
+    printf("%-24s peak=%zu count=%llu\n", name, peak - base,
+           (unsigned long long) count);
+
+    return count;
+}
+
+/* Run 'expr' once to warm up, then check that it allocates nothing. */
+#define NO_ALLOC(name, expr)                                                \
+    do {                                                                    \
+        EXIO_CHECK(expr);                                                   \
+        start();                                                            \
+        EXIO_CHECK(expr);                                                   \
+        EXIO_CHECK_MSG(stop(name) == 0, "%s allocated memory", name);       \
+    } while (0)
+
+/* Run 'expr' and report its footprint. */
+#define FOOTPRINT(name, expr)                                               \
+    do {                                                                    \
+        start();                                                            \
+        EXIO_CHECK(expr);                                                   \
+        stop(name);                                                         \
+    } while (0)
+
+static bool count_path(const char *path, void *arg)
+{
+    (void) path;
+    ++*(size_t *) arg;
+    return true;
+}
+
+int main(void)
+{
+    char root[] = "/tmp/exio-test-XXXXXX";
+    char path[PATH_MAX + 1], long_msg[4096], cmd[PATH_MAX + 16];
+
+    struct exio_glob   *glob;
+    struct exio_writer *w;
+
+    const char *paths[2];
+    uint32_t    crcs[2];
+    size_t      matches = 0;
+    int         saved, null;
+
+    EXIO_CHECK(mkdtemp(root));
+
+    memset(long_msg, 'x', sizeof(long_msg) - 1);
+    long_msg[sizeof(long_msg) - 1] = '\0';
+
+    /* The messages themselves are not of interest */
+    EXIO_CHECK((null = open("/dev/null", O_WRONLY)) != -1);
+    saved = dup(STDERR_FILENO);
+    dup2(null, STDERR_FILENO);
+
+    NO_ALLOC("info", info("short message"));
+    NO_ALLOC("warn", warn("%s", long_msg));
+    NO_ALLOC("err", err("%d", 42));
+
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+
+    NO_ALLOC("get_xdg_path",
+             get_xdg_path(path, "app", "HOME", ".config") == 0);
+    NO_ALLOC("fsize", fsize(null) >= 0);
+    NO_ALLOC("exio_fs_admit", exio_fs_admit(-1, PRIO_NORMAL));
+
+    snprintf(path, sizeof(path), "%s/dir", root);
+    NO_ALLOC("mkpath", mkpath(path));
+
+    snprintf(path, sizeof(path), "%s/file", root);
+    EXIO_CHECK((w = exio_writer_open(path, 0, 0, 0)));
+    NO_ALLOC("exio_writer_write", exio_writer_write(w, "data\n", 5));
+    EXIO_CHECK(exio_writer_close(w));
+
+    close(null);
+
+    /* Functions which are expected to allocate */
+    FOOTPRINT("exio_writer_open", (w = exio_writer_open(path, 0, 0, 0)));
+    EXIO_CHECK(exio_writer_close(w));
+
+    FOOTPRINT("exio_glob_compile", (glob = exio_glob_compile("**/*")));
+    FOOTPRINT("exio_glob", exio_glob(glob, root, count_path, &matches, 2));
+    exio_glob_free(glob);
+
+    paths[0] = paths[1] = path;
+    FOOTPRINT("exio_hash_files", exio_hash_files(paths, 2, crcs, 2));
+
+    snprintf(path, sizeof(path), "%s/dir", root);
+    snprintf(cmd, sizeof(cmd), "%s/copy", root);
+    FOOTPRINT("exio_copy_tree", exio_copy_tree(path, cmd, 0, 2));
+
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+    return system(cmd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/*
+ * Copying a tree with its metadata, including read-only directories, and
+ * replacing stale links in the destination.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+static void path(char *buf, const char *root, const char *name)
+{
+    snprintf(buf, PATH_MAX, "%s/%s", root, name);
+}
+
+static mode_t mode_of(const char *root, const char *name)
+{
+    char        buf[PATH_MAX];
+    struct stat st;
+
+    path(buf, root, name);
+    EXIO_CHECK(lstat(buf, &st) == 0);
+
+    return st.st_mode & 07777;
+}
+
+int main(void)
+{
+    char root[] = "/tmp/exio-test-XXXXXX";
+    char src[PATH_MAX], dst[PATH_MAX], buf[PATH_MAX], target[8];
+    int  fd;
+
+    /* Privileges would hide the problem */
+    if (geteuid() == 0) EXIO_CHECK(setgid(65534) == 0 && setuid(65534) == 0);
+
+    EXIO_CHECK(mkdtemp(root));
+    path(src, root, "src");
+    path(dst, root, "dst");
+
+    EXIO_CHECK(mkdir(src, 0755) == 0);
+    path(buf, src, "ro");
+    EXIO_CHECK(mkdir(buf, 0755) == 0);
+    path(buf, src, "ro/sub");
+    EXIO_CHECK(mkdir(buf, 0755) == 0);
+    path(buf, src, "ro/sub/file");
+    EXIO_CHECK((fd = open(buf, O_WRONLY | O_CREAT, 0444)) != -1);
+    EXIO_CHECK(write(fd, "data\n", 5) == 5);
+    close(fd);
+
+    path(buf, src, "ro/sub");
+    EXIO_CHECK(chmod(buf, 0500) == 0);
+    path(buf, src, "ro");
+    EXIO_CHECK(chmod(buf, 0555) == 0);
+
+    /* The destination holds a link left from an earlier copy */
+    path(buf, src, "lnk");
+    EXIO_CHECK(symlink("new", buf) == 0);
+    EXIO_CHECK(mkdir(dst, 0755) == 0);
+    path(buf, dst, "lnk");
+    EXIO_CHECK(symlink("old", buf) == 0);
+
+    EXIO_CHECK(exio_copy_tree(src, dst, COPY_META, 2));
+
+    EXIO_CHECK(mode_of(dst, "ro") == 0555);
+    EXIO_CHECK(mode_of(dst, "ro/sub") == 0500);
+    EXIO_CHECK(mode_of(dst, "ro/sub/file") == 0444);
+
+    /* Which takes the new target */
+    path(buf, dst, "lnk");
+    EXIO_CHECK(readlink(buf, target, sizeof(target)) == 3
+               && memcmp(target, "new", 3) == 0);
+
+    /* Clean up, opening the read-only directories again */
+    path(buf, dst, "ro");
+    chmod(buf, 0755);
+    path(buf, dst, "ro/sub");
+    chmod(buf, 0755);
+    path(buf, src, "ro");
+    chmod(buf, 0755);
+    path(buf, src, "ro/sub");
+    chmod(buf, 0755);
+
+    snprintf(buf, sizeof(buf), "rm -rf '%s'", root);
+    return system(buf) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* Fatal signals without a core: what is reported, and what may be dumped. */
+
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+static void on_signal(int signo)
+{
+    (void) signo;
+    _exit(EXIT_SUCCESS);
+}
+
+/* Raise 'signo' in a child without a core, and get what it reported. */
+static void report(int signo, char *buf, size_t size)
+{
+    ssize_t n;
+    pid_t   pid;
+    int     fds[2], status;
+
+    EXIO_CHECK(pipe(fds) == 0);
+    EXIO_CHECK((pid = fork()) != -1);
+
+    if (pid == 0) {
+        dup2(fds[1], STDERR_FILENO);
+        set_handler_segv(on_signal);
+        set_handler_term(on_signal);
+        EXIO_CHECK(set_core_mode(CORE_NONE));
+        raise(signo);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(fds[1]);
+    EXIO_CHECK((n = read(fds[0], buf, size - 1)) > 0);
+    buf[n] = '\0';
+    close(fds[0]);
+
+    EXIO_CHECK(waitpid(pid, &status, 0) == pid);
+    EXIO_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+int main(void)
+{
+    char buf[256];
+
+    /* Only signals which would have dumped a core say that none was */
+    report(SIGTERM, buf, sizeof(buf));
+    EXIO_CHECK(strstr(buf, "fatal signal 15\n"));
+    report(SIGINT, buf, sizeof(buf));
+    EXIO_CHECK(strstr(buf, "fatal signal 2\n"));
+    report(SIGABRT, buf, sizeof(buf));
+    EXIO_CHECK(strstr(buf, "fatal signal 6, no core dumped\n"));
+    report(SIGSEGV, buf, sizeof(buf));
+    EXIO_CHECK(strstr(buf, "fatal signal 11, no core dumped\n"));
+
+    /* A core pattern piping to a program ignores the size limit */
+    EXIO_CHECK(set_core_mode(CORE_NONE));
+    EXIO_CHECK(prctl(PR_GET_DUMPABLE, 0, 0, 0, 0) == 0);
+    EXIO_CHECK(set_core_mode(CORE_DEFAULT));
+    EXIO_CHECK(prctl(PR_GET_DUMPABLE, 0, 0, 0, 0) == 1);
+
+    return EXIT_SUCCESS;
+}
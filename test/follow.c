@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/*
+ * Following files: a line too long to buffer whole, a file that could not be
+ * added next to one that was, and a file created while another one changes.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+#define LONG    (3 * 1024 * 1024)
+
+static size_t parts, longest, total;
+static bool   got_short, got_late;
+static int    busy_fd, stop_busy;
+
+static bool on_line(const char *line, size_t len, void *arg)
+{
+    (void) arg;
+
+    if (len == 5 && memcmp(line, "short", 5) == 0) {
+        got_short = true;
+        return true;
+    }
+
+    ++parts, total += len;
+    if (len > longest) longest = len;
+
+    return true;
+}
+
+static bool on_late(const char *line, size_t len, void *arg)
+{
+    (void) arg;
+    if (len == 4 && memcmp(line, "late", 4) == 0) got_late = true;
+    return true;
+}
+
+static bool on_busy(const char *line, size_t len, void *arg)
+{
+    (void) line, (void) len, (void) arg;
+    return true;
+}
+
+/* Get the number of inotify watches held by the process. */
+static int count_watches(void)
+{
+    struct dirent *e;
+    DIR           *d;
+    FILE          *fp;
+
+    char link[PATH_MAX], path[PATH_MAX], line[256];
+    int  n = 0;
+
+    EXIO_CHECK((d = opendir("/proc/self/fd")));
+
+    while ((e = readdir(d))) {
+        ssize_t len;
+
+        snprintf(link, sizeof(link), "/proc/self/fd/%s", e->d_name);
+        if ((len = readlink(link, path, sizeof(path) - 1)) == -1) continue;
+        path[len] = '\0';
+        if (strcmp(path, "anon_inode:inotify") != 0) continue;
+
+        snprintf(link, sizeof(link), "/proc/self/fdinfo/%s", e->d_name);
+        EXIO_CHECK((fp = fopen(link, "r")));
+        while (fgets(line, sizeof(line), fp))
+            n += strncmp(line, "inotify wd:", 11) == 0;
+        fclose(fp);
+    }
+
+    closedir(d);
+    return n;
+}
+
+/* A file that fails to be added leaves the directory watch of its sibling. */
+static void check_shared_watch(const char *dir)
+{
+    struct exio_follow *f;
+
+    char path[PATH_MAX], loop[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/a.log", dir);
+    snprintf(loop, sizeof(loop), "%s/loop.log", dir);
+    EXIO_CHECK(symlink("loop.log", loop) == 0);
+
+    EXIO_CHECK((f = exio_follow_new()));
+    EXIO_CHECK(exio_follow_add(f, path, false, on_busy, NULL));
+    EXIO_CHECK(count_watches() == 1);
+
+    errno = 0;
+    EXIO_CHECK(!exio_follow_add(f, loop, false, on_busy, NULL)
+               && errno == ELOOP);
+    EXIO_CHECK(count_watches() == 1);
+
+    exio_follow_free(f);
+    unlink(loop);
+}
+
+static void *busy(void *arg)
+{
+    const struct timespec ts = { 0, 5000000 };
+
+    (void) arg;
+
+    while (!__atomic_load_n(&stop_busy, __ATOMIC_RELAXED)) {
+        EXIO_CHECK(write(busy_fd, "busy\n", 5) == 5);
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+/* A file in a directory created later is found while events keep coming. */
+static void check_late(const char *dir)
+{
+    struct exio_follow *f;
+    pthread_t           thread;
+    FILE               *fp;
+
+    char busy_path[PATH_MAX], sub[PATH_MAX], late[PATH_MAX];
+    int  i;
+
+    snprintf(busy_path, sizeof(busy_path), "%s/busy.log", dir);
+    snprintf(sub, sizeof(sub), "%s/sub", dir);
+    snprintf(late, sizeof(late), "%s/sub/late.log", dir);
+
+    EXIO_CHECK((busy_fd = open(busy_path, O_WRONLY | O_CREAT, 0600)) != -1);
+
+    EXIO_CHECK((f = exio_follow_new()));
+    EXIO_CHECK(exio_follow_add(f, busy_path, true, on_busy, NULL));
+    EXIO_CHECK(exio_follow_add(f, late, false, on_late, NULL));
+    EXIO_CHECK(exio_follow_wait(f, 0));
+
+    EXIO_CHECK(pthread_create(&thread, NULL, busy, NULL) == 0);
+
+    EXIO_CHECK(mkdir(sub, 0700) == 0);
+    EXIO_CHECK((fp = fopen(late, "w")));
+    fputs("late\n", fp);
+    fclose(fp);
+
+    for (i = 0; i < 300 && !got_late; ++i)
+        EXIO_CHECK(exio_follow_wait(f, 10));
+
+    __atomic_store_n(&stop_busy, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+
+    EXIO_CHECK(got_late);
+
+    exio_follow_free(f);
+    close(busy_fd);
+    unlink(late);
+    rmdir(sub);
+    unlink(busy_path);
+}
+
+int main(void)
+{
+    struct exio_follow *f;
+
+    char  path[] = "/var/tmp/exio-test-XXXXXX";
+    char  dir[] = "/var/tmp/exio-test-XXXXXX";
+    char *data;
+    int   fd, i;
+
+    EXIO_CHECK((data = malloc(LONG)));
+    memset(data, 'l', LONG);
+
+    EXIO_CHECK((fd = mkstemp(path)) != -1);
+    EXIO_CHECK(write(fd, data, LONG) == LONG);
+    EXIO_CHECK(write(fd, "\nshort\n", 7) == 7);
+    close(fd);
+
+    EXIO_CHECK((f = exio_follow_new()));
+    EXIO_CHECK(exio_follow_add(f, path, false, on_line, NULL));
+
+    for (i = 0; i < 5 && !got_short; ++i)
+        EXIO_CHECK(exio_follow_wait(f, 0));
+
+    EXIO_CHECK(got_short);
+    EXIO_CHECK(total == LONG);
+    EXIO_CHECK(parts > 1 && longest < LONG);
+
+    exio_follow_free(f);
+    unlink(path);
+    free(data);
+
+    EXIO_CHECK(mkdtemp(dir));
+    check_shared_watch(dir);
+    check_late(dir);
+    rmdir(dir);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* Identifiers of watched file systems, valid or not. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+int main(void)
+{
+    struct fs_info info;
+    int            fs;
+
+    /* Nothing is watched yet */
+    errno = 0;
+    EXIO_CHECK(!exio_fs_admit(0, PRIO_HIGH) && errno == EINVAL);
+    EXIO_CHECK(exio_fs_admit(-1, PRIO_LOW));
+
+    EXIO_CHECK((fs = exio_fs_watch("/var/tmp", 0, 0)) == 0);
+    EXIO_CHECK(exio_fs_admit(fs, PRIO_LOW));
+    EXIO_CHECK(exio_fs_info(fs, &info, true));
+
+    errno = 0;
+    EXIO_CHECK(!exio_fs_admit(fs + 1, PRIO_HIGH) && errno == EINVAL);
+    errno = 0;
+    EXIO_CHECK(!exio_fs_admit(1000, PRIO_HIGH) && errno == EINVAL);
+    errno = 0;
+    EXIO_CHECK(!exio_fs_info(1000, &info, false) && errno == EINVAL);
+
+    return EXIT_SUCCESS;
+}
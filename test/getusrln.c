@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* Input read into a caller's allocator must be freed with the right size. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+#define BLOCKS  64
+
+static struct {
+    void  *ptr;
+    size_t size;
+} blocks[BLOCKS];
+
+static void *track_alloc(size_t size, void *ctx)
+{
+    size_t i;
+
+    (void) ctx;
+    for (i = 0; i < BLOCKS && blocks[i].ptr; ++i);
+    EXIO_CHECK(i < BLOCKS);
+
+    EXIO_CHECK((blocks[i].ptr = malloc(size)));
+    blocks[i].size = size;
+
+    return blocks[i].ptr;
+}
+
+static void *track_realloc(void *ptr, size_t old_size, size_t size, void *ctx)
+{
+    (void) ptr, (void) old_size, (void) size, (void) ctx;
+    EXIO_CHECK(!"input buffers are never resized in place");
+    return NULL;
+}
+
+static void track_free(void *ptr, size_t size, void *ctx)
+{
+    size_t i;
+
+    (void) ctx;
+    for (i = 0; i < BLOCKS && blocks[i].ptr != ptr; ++i);
+
+    EXIO_CHECK(i < BLOCKS && blocks[i].size == size);
+    blocks[i].ptr = NULL;
+    free(ptr);
+}
+
+static const struct exio_allocator track = {
+    track_alloc, track_realloc, track_free, NULL
+};
+
+static void check_empty(void)
+{
+    size_t i;
+
+    for (i = 0; i < BLOCKS; ++i)
+        EXIO_CHECK(!blocks[i].ptr);
+}
+
+int main(void)
+{
+    static const char input[] = "ab\0cd\nhello\n";
+
+    char  *line;
+    size_t len;
+    int    fds[2];
+
+    EXIO_CHECK(pipe(fds) == 0);
+    EXIO_CHECK(write(fds[1], input, sizeof(input) - 1) == sizeof(input) - 1);
+    close(fds[1]);
+    EXIO_CHECK(dup2(fds[0], STDIN_FILENO) == STDIN_FILENO);
+
+    /* Without the length, the block is sized for the string */
+    EXIO_CHECK((line = exio_getusrln("", NULL, IN_SHOW, &track)));
+    EXIO_CHECK(strcmp(line, "ab") == 0);
+    track_free(line, strlen(line) + 1, NULL);
+    check_empty();
+
+    EXIO_CHECK((line = exio_getusrln("", &len, IN_SHOW, &track)));
+    EXIO_CHECK(len == 5 && memcmp(line, "hello", 6) == 0);
+    track_free(line, len + 1, NULL);
+    check_empty();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* Searching a tree with an unreadable directory in it. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+#define SIBLINGS    8
+
+static unsigned found;
+
+static void make(const char *root, const char *name, bool dir)
+{
+    char buf[PATH_MAX];
+    int  fd;
+
+    snprintf(buf, sizeof(buf), "%s/%s", root, name);
+
+    if (dir) {
+        EXIO_CHECK(mkdir(buf, 0755) == 0);
+    } else {
+        EXIO_CHECK((fd = open(buf, O_WRONLY | O_CREAT, 0644)) != -1);
+        close(fd);
+    }
+}
+
+static bool on_match(const char *path, void *arg)
+{
+    (void) path, (void) arg;
+    __atomic_add_fetch(&found, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+int main(void)
+{
+    struct exio_glob *g;
+
+    char root[] = "/tmp/exio-test-XXXXXX";
+    char name[64], buf[PATH_MAX];
+    int  i;
+
+    /* Privileges would hide the problem */
+    if (geteuid() == 0) EXIO_CHECK(setgid(65534) == 0 && setuid(65534) == 0);
+
+    EXIO_CHECK(mkdtemp(root));
+
+    /* The unreadable directory sorts first, so it is likely to be hit early */
+    make(root, "0locked", true);
+    make(root, "0locked/hidden.txt", false);
+    snprintf(buf, sizeof(buf), "%s/0locked", root);
+    EXIO_CHECK(chmod(buf, 0) == 0);
+
+    for (i = 0; i < SIBLINGS; ++i) {
+        snprintf(name, sizeof(name), "dir%d", i);
+        make(root, name, true);
+        snprintf(name, sizeof(name), "dir%d/sub", i);
+        make(root, name, true);
+        snprintf(name, sizeof(name), "dir%d/sub/file.txt", i);
+        make(root, name, false);
+    }
+
+    EXIO_CHECK((g = exio_glob_compile("**/*.txt")));
+
+    errno = 0;
+    EXIO_CHECK(!exio_glob(g, root, on_match, NULL, 4) && errno == EACCES);
+    EXIO_CHECK(found == SIBLINGS);
+
+    exio_glob_free(g);
+
+    EXIO_CHECK(chmod(buf, 0755) == 0);
+    snprintf(buf, sizeof(buf), "rm -rf '%s'", root);
+    return system(buf) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* Checksums of several files, including degenerate counts and failures. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+#define CHECK_CRC   0xe3069283      /* CRC32C of "123456789". */
+#define FILES       256
+
+static int budget;                      // Allocations left, or -1 for any
+
+static void *fail_alloc(size_t size, void *ctx)
+{
+    (void) ctx;
+    if (__atomic_load_n(&budget, __ATOMIC_RELAXED) != -1
+        && __atomic_fetch_sub(&budget, 1, __ATOMIC_RELAXED) <= 0)
+        return NULL;
+
+    return malloc(size);
+}
+
+static void *fail_realloc(void *ptr, size_t old_size, size_t size, void *ctx)
+{
+    (void) old_size, (void) ctx;
+    if (__atomic_load_n(&budget, __ATOMIC_RELAXED) != -1
+        && __atomic_fetch_sub(&budget, 1, __ATOMIC_RELAXED) <= 0)
+        return NULL;
+
+    return realloc(ptr, size);
+}
+
+static void fail_free(void *ptr, size_t size, void *ctx)
+{
+    (void) size, (void) ctx;
+    free(ptr);
+}
+
+static const struct exio_allocator failing = {
+    fail_alloc, fail_realloc, fail_free, NULL
+};
+
+int main(void)
+{
+    static const char *many[FILES];
+    static uint32_t    many_crcs[FILES];
+
+    const char *paths[2];
+    char        path[] = "/var/tmp/exio-test-XXXXXX";
+    uint32_t    crcs[2];
+    int         fd, i, left;
+    bool        ok;
+
+    EXIO_CHECK((fd = mkstemp(path)) != -1);
+    EXIO_CHECK(write(fd, "123456789", 9) == 9);
+    close(fd);
+
+    paths[0] = paths[1] = path;
+    EXIO_CHECK(exio_hash_files(paths, 2, crcs, 2));
+    EXIO_CHECK(crcs[0] == CHECK_CRC && crcs[1] == CHECK_CRC);
+
+    /* No files means nothing to do, so the arrays are never touched */
+    EXIO_CHECK(exio_hash_files(NULL, 0, NULL, 2));
+
+    /* A count whose array size overflows is refused before anything is read */
+    errno = 0;
+    EXIO_CHECK(!exio_hash_files(NULL, SIZE_MAX / 2 + 1, NULL, 2)
+               && errno == ENOMEM);
+
+    /* Whatever fails, no checksum is left unset */
+    for (i = 0; i < FILES; ++i) many[i] = path;
+    exio_set_allocator(&failing);
+
+    for (left = 0, ok = false; !ok; ++left) {
+        memset(many_crcs, 0xff, sizeof(many_crcs));
+        __atomic_store_n(&budget, left, __ATOMIC_RELAXED);
+        ok = exio_hash_files(many, FILES, many_crcs, 2);
+        __atomic_store_n(&budget, -1, __ATOMIC_RELAXED);
+
+        for (i = 0; i < FILES; ++i) {
+            EXIO_CHECK_MSG(many_crcs[i] == CHECK_CRC
+                           || (!ok && many_crcs[i] == 0),
+                           "checksum %d after %d allocations", i, left);
+        }
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
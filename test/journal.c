@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* A single writer per journal, and recovery past damage in the middle. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+#define RECORDS 5000
+
+static size_t count;
+static bool   got_last;
+
+static bool on_entry(const struct journal_entry *entry, void *arg)
+{
+    (void) arg;
+
+    ++count;
+    if (entry->len == 11 && memcmp(entry->text, "record 4999", 11) == 0)
+        got_last = true;
+
+    return true;
+}
+
+int main(void)
+{
+    struct exio_journal *j;
+
+    char path[] = "/var/tmp/exio-test-XXXXXX";
+    char text[32];
+    int  fd, i, len;
+
+    EXIO_CHECK((fd = mkstemp(path)) != -1);
+    close(fd);
+
+    EXIO_CHECK((j = exio_journal_open(path)));
+
+    /* A second writer would truncate the file under the first */
+    errno = 0;
+    EXIO_CHECK(!exio_journal_open(path) && errno == EWOULDBLOCK);
+
+    for (i = 0; i < RECORDS; ++i) {
+        len = snprintf(text, sizeof(text), "record %d", i);
+        EXIO_CHECK(exio_journal_write(j, LEVEL_INFO, text, len));
+    }
+
+    EXIO_CHECK(exio_journal_close(j));
+
+    /* Damage a record well before the end */
+    EXIO_CHECK((fd = open(path, O_RDWR)) != -1);
+    EXIO_CHECK(pwrite(fd, "\xff\xff\xff\xff", 4, 10000) == 4);
+    close(fd);
+
+    EXIO_CHECK((j = exio_journal_open(path)));
+    EXIO_CHECK(exio_journal_close(j));
+
+    EXIO_CHECK(exio_journal_read(path, on_entry, NULL));
+    EXIO_CHECK(got_last && count > RECORDS / 2 && count < RECORDS);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* Opening mapped logs, and leaving other files alone. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+#define HDR     65536
+
+static void check_foreign(const char *path)
+{
+    char        data[100], buf[sizeof(data) + 1];
+    struct stat st;
+    int         fd;
+
+    /* Leading null bytes look like an unformatted header */
+    memset(data, 0, 8);
+    memset(data + 8, 'f', sizeof(data) - 8);
+
+    EXIO_CHECK((fd = open(path, O_RDWR | O_TRUNC)) != -1);
+    EXIO_CHECK(write(fd, data, sizeof(data)) == sizeof(data));
+
+    errno = 0;
+    EXIO_CHECK(!exio_maplog_open(path, 0, 0) && errno == EINVAL);
+
+    EXIO_CHECK(fstat(fd, &st) == 0 && st.st_size == sizeof(data));
+    EXIO_CHECK(pread(fd, buf, sizeof(buf), 0) == sizeof(data));
+    EXIO_CHECK(memcmp(buf, data, sizeof(data)) == 0);
+    close(fd);
+}
+
+static void check_reopen(const char *path)
+{
+    struct exio_maplog *l;
+
+    char buf[10];
+    int  fd;
+
+    EXIO_CHECK(truncate(path, 0) == 0);
+
+    EXIO_CHECK((l = exio_maplog_open(path, 0, 1 << 20)));
+    EXIO_CHECK(exio_maplog_append(l, "hello", 5));
+    EXIO_CHECK(exio_maplog_close(l));
+
+    EXIO_CHECK((l = exio_maplog_open(path, 0, 1 << 20)));
+    EXIO_CHECK(exio_maplog_append(l, "world", 5));
+    EXIO_CHECK(exio_maplog_close(l));
+
+    EXIO_CHECK((fd = open(path, O_RDONLY)) != -1);
+    EXIO_CHECK(pread(fd, buf, sizeof(buf), HDR) == sizeof(buf));
+    EXIO_CHECK(memcmp(buf, "helloworld", sizeof(buf)) == 0);
+    close(fd);
+}
+
+int main(void)
+{
+    char path[] = "/var/tmp/exio-test-XXXXXX";
+    int  fd;
+
+    EXIO_CHECK((fd = mkstemp(path)) != -1);
+    close(fd);
+
+    check_foreign(path);
+    check_reopen(path);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/*
+ * Mirroring read-only directories, syncing the modes of existing ones, and
+ * replacing links past temporary files left behind.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+static void path(char *buf, const char *root, const char *name)
+{
+    snprintf(buf, PATH_MAX, "%s/%s", root, name);
+}
+
+static mode_t mode_of(const char *root, const char *name)
+{
+    char        buf[PATH_MAX];
+    struct stat st;
+
+    path(buf, root, name);
+    EXIO_CHECK(lstat(buf, &st) == 0);
+
+    return st.st_mode & 07777;
+}
+
+static void make_file(const char *root, const char *name)
+{
+    char buf[PATH_MAX];
+    int  fd;
+
+    path(buf, root, name);
+    EXIO_CHECK((fd = open(buf, O_WRONLY | O_CREAT, 0644)) != -1);
+    EXIO_CHECK(write(fd, "data\n", 5) == 5);
+    close(fd);
+}
+
+static void set_mode(const char *root, const char *name, mode_t mode)
+{
+    char buf[PATH_MAX];
+
+    path(buf, root, name);
+    EXIO_CHECK(chmod(buf, mode) == 0);
+}
+
+int main(void)
+{
+    char root[] = "/tmp/exio-test-XXXXXX";
+    char src[PATH_MAX], dst[PATH_MAX], buf[PATH_MAX], name[64];
+    int  i;
+
+    /* Privileges would hide the problem */
+    if (geteuid() == 0) EXIO_CHECK(setgid(65534) == 0 && setuid(65534) == 0);
+
+    EXIO_CHECK(mkdtemp(root));
+    path(src, root, "src");
+    path(dst, root, "dst");
+
+    EXIO_CHECK(mkdir(src, 0755) == 0);
+    path(buf, src, "ro");
+    EXIO_CHECK(mkdir(buf, 0755) == 0);
+    make_file(src, "ro/file");
+    set_mode(src, "ro", 0555);
+
+    /* A new read-only directory is only made read-only once filled */
+    EXIO_CHECK(exio_mirror(src, dst, MIRROR_META, NULL, 2));
+    EXIO_CHECK(mode_of(dst, "ro") == 0555);
+    EXIO_CHECK(mode_of(dst, "ro/file") == 0644);
+
+    /* An existing read-only directory still takes new files */
+    set_mode(src, "ro", 0755);
+    make_file(src, "ro/new");
+    set_mode(src, "ro", 0555);
+
+    EXIO_CHECK(exio_mirror(src, dst, MIRROR_META, NULL, 2));
+    EXIO_CHECK(mode_of(dst, "ro") == 0555);
+    EXIO_CHECK(mode_of(dst, "ro/new") == 0644);
+
+    /* The mode of an existing directory follows the source */
+    set_mode(src, "ro", 0750);
+    EXIO_CHECK(exio_mirror(src, dst, MIRROR_META, NULL, 2));
+    EXIO_CHECK(mode_of(dst, "ro") == 0750);
+
+    /* Temporary names taken by an earlier run are skipped */
+    path(buf, src, "lnk");
+    EXIO_CHECK(symlink("new", buf) == 0);
+    path(buf, dst, "lnk");
+    EXIO_CHECK(symlink("old", buf) == 0);
+
+    snprintf(name, sizeof(name), "lnk.exio-%ld", (long) getpid());
+    make_file(dst, name);
+
+    for (i = 1; i <= 64; ++i) {
+        snprintf(name, sizeof(name), ".exio-%ld-%d", (long) getpid(), i);
+        make_file(dst, name);
+    }
+
+    EXIO_CHECK(exio_mirror(src, dst, MIRROR_KEEP, NULL, 2));
+    path(buf, dst, "lnk");
+    EXIO_CHECK(readlink(buf, name, sizeof(name)) == 3
+               && memcmp(name, "new", 3) == 0);
+
+    set_mode(dst, "ro", 0755);
+    snprintf(buf, sizeof(buf), "rm -rf '%s'", root);
+    return system(buf) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* Creating paths through the cache of parent directories. */
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+static bool is_dir(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+int main(void)
+{
+    char root[] = "/tmp/exio-test-XXXXXX";
+    char path[PATH_MAX], nested[PATH_MAX], sibling[PATH_MAX];
+    int  i;
+
+    EXIO_CHECK(mkdtemp(root));
+
+    snprintf(path, sizeof(path), "%s/dcy/logs", root);
+    snprintf(nested, sizeof(nested), "%s/dcy/logs/logs", root);
+    snprintf(sibling, sizeof(sibling), "%s/dcy/data", root);
+
+    /* An existing path is left as is, and the parent is cached as itself */
+    for (i = 0; i < 3; ++i)
+        EXIO_CHECK(mkpath(path));
+
+    EXIO_CHECK(is_dir(path));
+    EXIO_CHECK(!is_dir(nested));
+
+    EXIO_CHECK(mkpath(sibling));
+    EXIO_CHECK(is_dir(sibling));
+
+    rmdir(sibling);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/dcy", root);
+    rmdir(path);
+    rmdir(root);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* Buffered messages are written out on a signal and when the buffer changes. */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+static int out = -1;
+static int handled;
+
+static void on_term(int signo)
+{
+    (void) signo;
+    ++handled;
+}
+
+/* Check that what was written to 'stderr' since the last call contains
+   'expect', or nothing at all if NULL. */
+static void check_out(const char *expect)
+{
+    char    buf[4096];
+    ssize_t n = read(out, buf, sizeof(buf) - 1);
+
+    if (!expect) {
+        EXIO_CHECK(n == -1);
+        return;
+    }
+
+    EXIO_CHECK(n > 0);
+    buf[n] = '\0';
+    EXIO_CHECK(strstr(buf, expect));
+}
+
+int main(void)
+{
+    int fds[2];
+
+    EXIO_CHECK(pipe(fds) == 0);
+    EXIO_CHECK(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    EXIO_CHECK(dup2(fds[1], STDERR_FILENO) == STDERR_FILENO);
+    close(fds[1]);
+    out = fds[0];
+
+    set_handler_term(on_term);
+
+    EXIO_CHECK(exio_msg_buffer(256, 0, 0));
+    EXIO_CHECK(info("one"));
+    check_out(NULL);
+
+    EXIO_CHECK(raise(SIGUSR1) == 0);
+    EXIO_CHECK(handled == 1);
+    check_out("one");
+
+    /* Replacing the buffer writes it out, and a smaller one reuses it */
+    EXIO_CHECK(info("two"));
+    EXIO_CHECK(exio_msg_buffer(512, 0, 0));
+    check_out("two");
+    EXIO_CHECK(exio_msg_buffer(64, 0, 0));
+
+    EXIO_CHECK(info("three"));
+    check_out(NULL);
+    EXIO_CHECK(raise(SIGUSR1) == 0);
+    check_out("three");
+
+    EXIO_CHECK(info("four"));
+    EXIO_CHECK(exio_msg_buffer(0, 0, 0));
+    check_out("four");
+
+    EXIO_CHECK(info("five"));
+    check_out("five");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/*
+ * System call budgets of the basic functions.
+ *
+ * The file system, input, output and terminal calls of the C library are
+ * interposed to count them, in the manner of an 'LD_PRELOAD' shim: as the
+ * library is linked into this program, its calls resolve to the definitions
+ * below, which forward to the next definition. Link with '-ldl' on older C
+ * libraries.
+ *
+ * Writes made by stdio within the C library do not go through these, so
+ * 'stderr' is a datagram socket instead, where every write arrives as one
+ * packet and is counted on the other end.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+static struct {
+    unsigned total;
+    unsigned open;                      // By absolute path, bypassing the cache
+    unsigned err;                       // Writes to 'stderr', counted twice
+} calls;
+
+static int         err_sock = -1;       // Receives what is written to 'stderr'
+static int         real_err = -1;
+static int         pty = -1;
+static const char *pty_input;           // Typed once echoing is turned off
+
+#define REAL(name) \
+    ((__typeof__(&name)) dlsym(RTLD_NEXT, #name))
+
+int open(const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t  mode;
+
+    va_start(ap, flags);
+    mode = (flags & (O_CREAT | O_TMPFILE)) ? va_arg(ap, mode_t) : 0;
+    va_end(ap);
+
+    ++calls.total, ++calls.open;
+    return REAL(open)(path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t  mode;
+
+    va_start(ap, flags);
+    mode = (flags & (O_CREAT | O_TMPFILE)) ? va_arg(ap, mode_t) : 0;
+    va_end(ap);
+
+    ++calls.total;
+    if (*path == '/') ++calls.open;
+    return REAL(openat)(dirfd, path, flags, mode);
+}
+
+int mkdir(const char *path, mode_t mode)
+{
+    ++calls.total;
+    return REAL(mkdir)(path, mode);
+}
+
+int mkdirat(int dirfd, const char *path, mode_t mode)
+{
+    ++calls.total;
+    return REAL(mkdirat)(dirfd, path, mode);
+}
+
+int fstat(int fd, struct stat *st)
+{
+    ++calls.total;
+    return REAL(fstat)(fd, st);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+    ++calls.total;
+    return REAL(fstatat)(dirfd, path, st, flags);
+}
+
+int stat(const char *path, struct stat *st)
+{
+    ++calls.total;
+    return REAL(stat)(path, st);
+}
+
+int close(int fd)
+{
+    ++calls.total;
+    return REAL(close)(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t len)
+{
+    ++calls.total;
+    return REAL(read)(fd, buf, len);
+}
+
+ssize_t write(int fd, const void *buf, size_t len)
+{
+    ++calls.total;
+    if (fd == STDERR_FILENO) ++calls.err;
+    return REAL(write)(fd, buf, len);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int cnt)
+{
+    ++calls.total;
+    if (fd == STDERR_FILENO) ++calls.err;
+    return REAL(writev)(fd, iov, cnt);
+}
+
+int tcgetattr(int fd, struct termios *t)
+{
+    ++calls.total;
+    return REAL(tcgetattr)(fd, t);
+}
+
+int tcsetattr(int fd, int action, const struct termios *t)
+{
+    int ret;
+
+    ++calls.total;
+    ret = REAL(tcsetattr)(fd, action, t);
+
+    /* Input typed earlier would be flushed when the terminal is set up */
+    if (ret == 0 && pty_input && !(t->c_lflag & ECHO)) {
+        REAL(write)(pty, pty_input, strlen(pty_input));
+        pty_input = NULL;
+    }
+
+    return ret;
+}
+
+/* Count the writes to 'stderr' which did not go through 'write()' above. */
+static unsigned stderr_writes(void)
+{
+    char     buf[4096];
+    unsigned n = 0;
+
+    fflush(stderr);
+    while (recv(err_sock, buf, sizeof(buf), MSG_DONTWAIT) >= 0) ++n;
+
+    return n - calls.err;
+}
+
+/* Run 'expr' and check that it made at most 'budget' calls. 'stderr' is put
+   back before failing, so that the failure is seen. */
+#define BUDGET(budget, expr)                                                \
+    do {                                                                    \
+        bool ok;                                                            \
+                                                                            \
+        stderr_writes();                                                    \
+        calls.total = calls.open = calls.err = 0;                           \
+        ok = (expr);                                                        \
+        calls.total += stderr_writes();                                     \
+                                                                            \
+        if (!ok || calls.total > (budget)) dup2(real_err, STDERR_FILENO);   \
+        EXIO_CHECK_MSG(ok, "%s", #expr);                                    \
+        EXIO_CHECK_MSG(calls.total <= (budget), "%u calls", calls.total);   \
+    } while (0)
+
+/* Read a line of input with 'mode', which must be 'expect'. */
+static bool read_input(enum input_mode mode, const char *expect)
+{
+    char  *line;
+    size_t len;
+    bool   ret;
+
+    if (!(line = getusrln("input: ", &len, mode))) return false;
+
+    ret = len == strlen(expect) && memcmp(line, expect, len) == 0;
+    free(line);
+
+    return ret;
+}
+
+/* Make 'stdin' a pipe holding 'input', or the terminal 'pty' if NULL. */
+static void set_stdin(const char *input)
+{
+    int fds[2], fd;
+
+    if (input) {
+        EXIO_CHECK(pipe(fds) == 0);
+        EXIO_CHECK(write(fds[1], input, strlen(input))
+                   == (ssize_t) strlen(input));
+        fd = fds[0];
+    } else {
+        EXIO_CHECK((pty = posix_openpt(O_RDWR | O_NOCTTY)) != -1);
+        EXIO_CHECK(grantpt(pty) == 0 && unlockpt(pty) == 0);
+        EXIO_CHECK((fd = open(ptsname(pty), O_RDWR | O_NOCTTY)) != -1);
+    }
+
+    EXIO_CHECK(dup2(fd, STDIN_FILENO) == STDIN_FILENO);
+    close(fd);
+    clearerr(stdin);
+}
+
+int main(void)
+{
+    char   root[] = "/tmp/exio-test-XXXXXX";
+    char   path[PATH_MAX + 1], cmd[PATH_MAX + 16], msg[2048];
+    char  *secret;
+    size_t len;
+    int    fds[2], fd;
+
+    EXIO_CHECK(mkdtemp(root));
+
+    EXIO_CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+    EXIO_CHECK((real_err = dup(STDERR_FILENO)) != -1);
+    EXIO_CHECK(dup2(fds[0], STDERR_FILENO) == STDERR_FILENO);
+    close(fds[0]);
+    err_sock = fds[1];
+
+    /* A message is written at once, even past the stack buffer once the
+       scratch buffer exists */
+    memset(msg, 'm', sizeof(msg) - 1);
+    msg[sizeof(msg) - 1] = '\0';
+
+    BUDGET(1, err("budget %d", 1));
+    BUDGET(1, warn("budget %d", 1));
+    BUDGET(1, info("budget %d", 1));
+    EXIO_CHECK(info("%s", msg));
+    BUDGET(1, err("%s", msg));
+
+    /* The prompt is the only call besides reading, and hiding the input adds
+       getting and setting the terminal attributes, and the newline */
+    set_stdin("secret\n");
+    BUDGET(1, read_input(IN_SHOW, "secret"));
+
+    set_stdin(NULL);
+    pty_input = "hidden\n";
+    BUDGET(5, read_input(IN_HIDE, "hidden"));
+
+    /* Makes none at all */
+    setenv("XDG_CACHE_HOME", root, 1);
+    BUDGET(0, get_xdg_path(path, "app", "XDG_CACHE_HOME", ".cache") == 0);
+    unsetenv("XDG_CACHE_HOME");
+    BUDGET(0, get_xdg_path(path, "app", "XDG_CACHE_HOME", ".cache") == 0);
+
+    BUDGET(1, fsize(STDIN_FILENO) >= -1);
+
+    /* A regular file is read up to its size, which takes a single read */
+    snprintf(path, sizeof(path), "%s/secret", root);
+    EXIO_CHECK((fd = open(path, O_RDWR | O_CREAT, 0600)) != -1);
+    EXIO_CHECK(pwrite(fd, "token\n", 6, 0) == 6);
+    BUDGET(2, (secret = exio_read_secret_fd(fd, &len)) && len == 5);
+    exio_free_secret(secret);
+    close(fd);
+
+    /* The first call caches the parent, after which an existing path or a new
+       directory within it takes a single call */
+    snprintf(path, sizeof(path), "%s/logs", root);
+    BUDGET(2, mkpath(path));
+    BUDGET(1, mkpath(path));
+    BUDGET(1, mkpath(path));
+
+    snprintf(path, sizeof(path), "%s/data", root);
+    BUDGET(1, mkpath(path));
+
+    /* A missing intermediate directory must not evict the cached root, so
+       later paths are still resolved from it rather than from '/' */
+    snprintf(path, sizeof(path), "%s/a/b", root);
+    BUDGET(8, mkpath(path));
+    snprintf(path, sizeof(path), "%s/c/d", root);
+    BUDGET(8, mkpath(path));
+    EXIO_CHECK_MSG(calls.open == 0, "%u opens by absolute path", calls.open);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+    return system(cmd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
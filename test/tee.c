@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* A slow output of 'exio_tee()' must not hold up the others. */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+#define SIZE    (256 * 1024)
+
+static int in[2], fast[2], slow[2];
+
+static void *run_tee(void *arg)
+{
+    int outs[2];
+
+    (void) arg;
+    outs[0] = slow[1];
+    outs[1] = fast[1];
+
+    EXIO_CHECK(exio_tee(in[0], outs, 2));
+    close(slow[1]);
+    close(fast[1]);
+
+    return NULL;
+}
+
+static void *feed(void *arg)
+{
+    static char data[SIZE];
+
+    (void) arg;
+    memset(data, 'x', sizeof(data));
+    EXIO_CHECK(write(in[1], data, sizeof(data)) == sizeof(data));
+    close(in[1]);
+
+    return NULL;
+}
+
+/* Read 'len' bytes from 'fd', or until EOF if 'len' is 0. */
+static size_t drain(int fd, size_t len)
+{
+    char    buf[65536];
+    size_t  total = 0;
+    ssize_t n = 1;
+
+    while ((!len || total < len) && (n = read(fd, buf, sizeof(buf))) > 0)
+        total += n;
+
+    EXIO_CHECK(n >= 0);
+    return total;
+}
+
+int main(void)
+{
+    pthread_t tee_thread, feed_thread;
+
+    EXIO_CHECK(pipe(in) == 0 && pipe(fast) == 0 && pipe(slow) == 0);
+
+    /* A stall kills the test rather than hanging it */
+    alarm(10);
+
+    EXIO_CHECK(pthread_create(&tee_thread, NULL, run_tee, NULL) == 0);
+    EXIO_CHECK(pthread_create(&feed_thread, NULL, feed, NULL) == 0);
+
+    /* Nothing reads the slow output until the fast one has everything */
+    EXIO_CHECK(drain(fast[0], SIZE) == SIZE);
+    EXIO_CHECK(drain(slow[0], 0) == SIZE);
+    EXIO_CHECK(drain(fast[0], 0) == 0);
+
+    pthread_join(feed_thread, NULL);
+    pthread_join(tee_thread, NULL);
+
+    return EXIT_SUCCESS;
+}
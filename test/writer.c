@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 Emil Overbeck <emil.a.overbeck at gmail dot com>
+ * Subject to the MIT License. See LICENSE.txt for more information.
+ *
+ */
+
+/* Flushing the buffered writer, with and without direct IO. */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exio.h"
+
+#define BLOCK   8192
+
+static void check_flushes(const char *path, int flags)
+{
+    static const char msg[] = "hello world\n";
+
+    struct exio_writer *w;
+
+    char    block[BLOCK], buf[BLOCK + sizeof(msg)];
+    ssize_t n;
+    int     fd;
+
+    memset(block, 'A', sizeof(block));
+
+    /* A partial block flushed after a whole one must not be overwritten */
+    EXIO_CHECK((w = exio_writer_open(path, flags, 0, 0)));
+    EXIO_CHECK(exio_writer_write(w, block, sizeof(block)));
+    EXIO_CHECK(exio_writer_flush(w));
+    EXIO_CHECK(exio_writer_write(w, msg, sizeof(msg) - 1));
+    EXIO_CHECK(exio_writer_flush(w));
+    EXIO_CHECK(exio_writer_close(w));
+
+    EXIO_CHECK((fd = open(path, O_RDONLY)) != -1);
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    EXIO_CHECK(n == BLOCK + (ssize_t) sizeof(msg) - 1);
+    EXIO_CHECK(memcmp(buf, block, BLOCK) == 0);
+    EXIO_CHECK(memcmp(buf + BLOCK, msg, sizeof(msg) - 1) == 0);
+}
+
+int main(void)
+{
+    char path[] = "/var/tmp/exio-test-XXXXXX";
+    int  fd;
+
+    EXIO_CHECK((fd = mkstemp(path)) != -1);
+    close(fd);
+
+    check_flushes(path, 0);
+    check_flushes(path, WRITER_DIRECT);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}